@@ -38,11 +38,91 @@
 #include <sys/mman.h>
 
 #include <va/va_drmcommon.h>
+#include <linux/dma-buf.h>
 #include <linux/videodev2.h>
 
 #include "utils.h"
 #include "v4l2.h"
 
+static int buffer_pool_class(unsigned int size)
+{
+	unsigned int class_size = 1 << BUFFER_POOL_CLASS_SHIFT;
+	int class = 0;
+
+	while (class_size < size) {
+		class_size <<= 1;
+		class++;
+	}
+
+	if (class >= BUFFER_POOL_CLASSES)
+		return -1;
+
+	return class;
+}
+
+void buffer_pool_init(struct buffer_pool *pool)
+{
+	pthread_mutex_init(&pool->mutex, NULL);
+}
+
+void *buffer_pool_get(struct buffer_pool *pool, unsigned int size)
+{
+	void *data = NULL;
+	int class;
+
+	class = buffer_pool_class(size);
+	if (class < 0)
+		return malloc(size);
+
+	pthread_mutex_lock(&pool->mutex);
+
+	if (pool->classes[class].count > 0)
+		data = pool->classes[class].data[--pool->classes[class].count];
+
+	pthread_mutex_unlock(&pool->mutex);
+
+	if (data == NULL)
+		data = malloc(1 << (BUFFER_POOL_CLASS_SHIFT + class));
+
+	return data;
+}
+
+void buffer_pool_put(struct buffer_pool *pool, void *data, unsigned int size)
+{
+	int class;
+
+	class = buffer_pool_class(size);
+	if (class < 0) {
+		free(data);
+		return;
+	}
+
+	pthread_mutex_lock(&pool->mutex);
+
+	if (pool->classes[class].count < BUFFER_POOL_DEPTH) {
+		pool->classes[class].data[pool->classes[class].count++] = data;
+		data = NULL;
+	}
+
+	pthread_mutex_unlock(&pool->mutex);
+
+	free(data);
+}
+
+void buffer_pool_destroy(struct buffer_pool *pool)
+{
+	unsigned int i, j;
+
+	for (i = 0; i < BUFFER_POOL_CLASSES; i++) {
+		for (j = 0; j < pool->classes[i].count; j++)
+			free(pool->classes[i].data[j]);
+
+		pool->classes[i].count = 0;
+	}
+
+	pthread_mutex_destroy(&pool->mutex);
+}
+
 VAStatus RequestCreateBuffer(VADriverContextP context, VAContextID context_id,
 			     VABufferType type, unsigned int size,
 			     unsigned int count, void *data,
@@ -50,6 +130,9 @@ VAStatus RequestCreateBuffer(VADriverContextP context, VAContextID context_id,
 {
 	struct request_data *driver_data = context->pDriverData;
 	struct object_buffer *buffer_object = NULL;
+	struct object_context *context_object;
+	struct context_source *source = NULL;
+	unsigned int source_offset = 0;
 	void *buffer_data;
 	VAStatus status;
 	VABufferID id;
@@ -74,10 +157,32 @@ VAStatus RequestCreateBuffer(VADriverContextP context, VAContextID context_id,
 		goto error;
 	}
 
-	buffer_data = malloc(size * count);
-	if (buffer_data == NULL) {
-		status = VA_STATUS_ERROR_ALLOCATION_FAILED;
-		goto error;
+	if (type == VASliceDataBufferType) {
+		context_object = CONTEXT(driver_data, context_id);
+		if (context_object != NULL)
+			source = context_source_bind(driver_data,
+						     context_object,
+						     size * count,
+						     &source_offset);
+	}
+
+	if (source != NULL) {
+		buffer_data = source->data + source_offset;
+	} else if (type != VAImageBufferType &&
+		   size * count <= BUFFER_INLINE_SIZE) {
+		buffer_data = buffer_object->inline_data;
+	} else {
+		if (type == VAImageBufferType)
+			buffer_data = image_pool_get(&driver_data->image_pool,
+						     size * count);
+		else
+			buffer_data = buffer_pool_get(&driver_data->buffer_pool,
+						      size * count);
+
+		if (buffer_data == NULL) {
+			status = VA_STATUS_ERROR_ALLOCATION_FAILED;
+			goto error;
+		}
 	}
 
 	if (data != NULL)
@@ -89,7 +194,15 @@ VAStatus RequestCreateBuffer(VADriverContextP context, VAContextID context_id,
 	buffer_object->data = buffer_data;
 	buffer_object->size = size;
 
+	buffer_object->context_id = context_id;
+	buffer_object->source = source;
+	buffer_object->source_offset = source_offset;
+
+	buffer_object->references = 1;
+	buffer_object->destroyed = false;
+
 	buffer_object->derived_surface_id = VA_INVALID_ID;
+	buffer_object->derived_alias = false;
 	buffer_object->info.handle = (uintptr_t) -1;
 
 	*buffer_id = id;
@@ -106,6 +219,54 @@ complete:
 	return status;
 }
 
+static void buffer_destroy(struct request_data *driver_data,
+			   struct object_buffer *buffer_object)
+{
+	struct object_context *context_object;
+	struct object_surface *surface_object;
+
+	if (buffer_object->derived_alias) {
+		surface_object = SURFACE(driver_data,
+					 buffer_object->derived_surface_id);
+		if (surface_object != NULL) {
+			surface_sync(surface_object,
+				     DMA_BUF_SYNC_END | DMA_BUF_SYNC_RW);
+			surface_map_release(driver_data, surface_object);
+		}
+	} else if (buffer_object->source != NULL) {
+		context_object = CONTEXT(driver_data,
+					 buffer_object->context_id);
+		if (context_object != NULL)
+			context_source_unbind(driver_data, context_object,
+					      buffer_object->source);
+	} else if (buffer_object->type == VAImageBufferType) {
+		image_pool_put(&driver_data->image_pool, buffer_object->data,
+			       buffer_object->size *
+			       buffer_object->initial_count);
+	} else if (buffer_object->data != NULL &&
+		   buffer_object->data != buffer_object->inline_data) {
+		buffer_pool_put(&driver_data->buffer_pool, buffer_object->data,
+				buffer_object->size *
+				buffer_object->initial_count);
+	}
+
+	object_heap_free(&driver_data->buffer_heap,
+			 (struct object_base *)buffer_object);
+}
+
+void buffer_reference(struct object_buffer *buffer_object)
+{
+	__atomic_add_fetch(&buffer_object->references, 1, __ATOMIC_RELAXED);
+}
+
+void buffer_release(struct request_data *driver_data,
+		    struct object_buffer *buffer_object)
+{
+	if (__atomic_sub_fetch(&buffer_object->references, 1,
+			       __ATOMIC_ACQ_REL) == 0)
+		buffer_destroy(driver_data, buffer_object);
+}
+
 VAStatus RequestDestroyBuffer(VADriverContextP context, VABufferID buffer_id)
 {
 	struct request_data *driver_data = context->pDriverData;
@@ -115,11 +276,12 @@ VAStatus RequestDestroyBuffer(VADriverContextP context, VABufferID buffer_id)
 	if (buffer_object == NULL)
 		return VA_STATUS_ERROR_INVALID_BUFFER;
 
-	if (buffer_object->data != NULL)
-		free(buffer_object->data);
+	if (__atomic_exchange_n(&buffer_object->destroyed, true,
+				__ATOMIC_ACQ_REL))
+		return VA_STATUS_ERROR_INVALID_BUFFER;
 
-	object_heap_free(&driver_data->buffer_heap,
-			 (struct object_base *)buffer_object);
+	/* Pictures still referencing the buffer destroy it when done. */
+	buffer_release(driver_data, buffer_object);
 
 	return VA_STATUS_SUCCESS;
 }
@@ -198,7 +360,6 @@ VAStatus RequestAcquireBufferHandle(VADriverContextP context,
 	struct object_buffer *buffer_object;
 	struct object_surface *surface_object;
 	struct video_format *video_format;
-	unsigned int capture_type;
 	int export_fd;
 	int rc;
 
@@ -206,8 +367,6 @@ VAStatus RequestAcquireBufferHandle(VADriverContextP context,
 	if (video_format == NULL)
 		return VA_STATUS_ERROR_OPERATION_FAILED;
 
-	capture_type = v4l2_type_video_capture(video_format->v4l2_mplane);
-
 	if (buffer_info->mem_type != VA_SURFACE_ATTRIB_MEM_TYPE_DRM_PRIME ||
 	    !video_format_is_linear(driver_data->video_format))
 		return VA_STATUS_ERROR_UNSUPPORTED_MEMORY_TYPE;
@@ -226,9 +385,7 @@ VAStatus RequestAcquireBufferHandle(VADriverContextP context,
 	if (surface_object->destination_buffers_count > 1)
 		return VA_STATUS_ERROR_OPERATION_FAILED;
 
-	rc = v4l2_export_buffer(driver_data->video_fd, capture_type,
-				surface_object->destination_index, O_RDONLY,
-				&export_fd, 1);
+	rc = surface_export_buffers(driver_data, surface_object, &export_fd, 1);
 	if (rc < 0)
 		return VA_STATUS_ERROR_OPERATION_FAILED;
 
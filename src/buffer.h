@@ -26,14 +26,40 @@
 #ifndef _BUFFER_H_
 #define _BUFFER_H_
 
+#include <pthread.h>
+#include <stdbool.h>
+
 #include <va/va_backend.h>
 
 #include "object_heap.h"
-#include "request.h"
 
 #define BUFFER(data, id)                                                       \
 	((struct object_buffer *)object_heap_lookup(&(data)->buffer_heap, id))
 #define BUFFER_ID_OFFSET		0x08000000
+#define BUFFER_HEAP_PREALLOCATE		32
+
+/* Picture parameters and matrices fit in the buffer object. */
+#define BUFFER_INLINE_SIZE		1024
+
+/* Pooled data sizes, from 2 KiB to 256 KiB. */
+#define BUFFER_POOL_CLASS_SHIFT		11
+#define BUFFER_POOL_CLASSES		8
+#define BUFFER_POOL_DEPTH		8
+
+struct request_data;
+struct context_source;
+
+/*
+ * Buffer data given back when buffers are destroyed, kept by power of two
+ * size classes so that the buffers created for each picture reuse it.
+ */
+struct buffer_pool {
+	pthread_mutex_t mutex;
+	struct {
+		void *data[BUFFER_POOL_DEPTH];
+		unsigned int count;
+	} classes[BUFFER_POOL_CLASSES];
+};
 
 struct object_buffer {
 	struct object_base base;
@@ -45,10 +71,35 @@ struct object_buffer {
 	void *data;
 	unsigned int size;
 
+	/* Slice data written straight to a context source. */
+	VAContextID context_id;
+	struct context_source *source;
+	unsigned int source_offset;
+
+	/*
+	 * References held by the client until it destroys the buffer and by
+	 * the pictures using it, updated atomically as pictures are ended from
+	 * any thread. The buffer is destroyed with the last one.
+	 */
+	unsigned int references;
+	bool destroyed;
+
 	VASurfaceID derived_surface_id;
+	/* Derived image data pointing to the surface mapping. */
+	bool derived_alias;
 	VABufferInfo info;
+
+	unsigned char inline_data[BUFFER_INLINE_SIZE];
 };
 
+void buffer_reference(struct object_buffer *buffer_object);
+void buffer_release(struct request_data *driver_data,
+		    struct object_buffer *buffer_object);
+void buffer_pool_init(struct buffer_pool *pool);
+void *buffer_pool_get(struct buffer_pool *pool, unsigned int size);
+void buffer_pool_put(struct buffer_pool *pool, void *data, unsigned int size);
+void buffer_pool_destroy(struct buffer_pool *pool);
+
 VAStatus RequestCreateBuffer(VADriverContextP context, VAContextID context_id,
 			     VABufferType type, unsigned int size,
 			     unsigned int count, void *data,
@@ -23,19 +23,27 @@
  * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
  */
 
+#define _GNU_SOURCE
+
 #include "context.h"
+#include "buffer.h"
 #include "config.h"
 #include "request.h"
 #include "surface.h"
 
+#include <errno.h>
+#include <pthread.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 
 #include <assert.h>
 
+#include <fcntl.h>
 #include <sys/ioctl.h>
 #include <sys/mman.h>
 
+#include <linux/udmabuf.h>
 #include <linux/videodev2.h>
 
 #include "utils.h"
@@ -43,6 +51,339 @@
 
 #include "autoconfig.h"
 
+/*
+ * Size output buffers for a typical picture rather than the worst case: the
+ * uncompressed 4:2:0 picture over the minimum compression ratio that levels
+ * allow at that resolution (2 up to standard definition and 4 above for H264
+ * and HEVC, 2 for MPEG2). Sources are grown for larger pictures.
+ */
+static unsigned int context_source_size(unsigned int pixelformat,
+					unsigned int width,
+					unsigned int height)
+{
+	unsigned int size = width * height * 3 / 2;
+	unsigned int page_size = getpagesize();
+
+	if (pixelformat == V4L2_PIX_FMT_MPEG2_SLICE ||
+	    width * height <= 720 * 576)
+		size /= 2;
+	else
+		size /= 4;
+
+	if (size < SOURCE_SIZE_MIN)
+		size = SOURCE_SIZE_MIN;
+
+	return (size + page_size - 1) / page_size * page_size;
+}
+
+/*
+ * Back a source with memory: a mapping of its V4L2 buffer for MMAP memory, or
+ * a memfd exported as DMABUF through udmabuf for DMABUF memory. DMABUF sources
+ * are given to V4L2 with each queueing, so they can be replaced without
+ * creating new V4L2 buffers.
+ */
+static int context_source_map(struct request_data *driver_data,
+			      struct object_context *context_object,
+			      struct context_source *source, unsigned int size)
+{
+	struct video_format *video_format = driver_data->video_format;
+	struct udmabuf_create udmabuf_create;
+	unsigned int page_size = getpagesize();
+	unsigned int output_type;
+	unsigned int length;
+	unsigned int offset;
+	void *data;
+	int memfd;
+	int fd;
+	int rc;
+
+	if (source->memory == V4L2_MEMORY_MMAP) {
+		output_type = v4l2_type_video_output(video_format->v4l2_mplane);
+
+		rc = v4l2_query_buffer(driver_data->video_fd, output_type,
+				       source->index, &length, &offset, 1);
+		if (rc < 0)
+			return -1;
+
+		data = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_SHARED,
+			    driver_data->video_fd, offset);
+		if (data == MAP_FAILED)
+			return -1;
+
+		source->data = data;
+		source->size = length;
+		source->fd = -1;
+
+		return 0;
+	}
+
+	size = (size + page_size - 1) / page_size * page_size;
+
+	memfd = memfd_create("libva-v4l2-request-source", MFD_ALLOW_SEALING);
+	if (memfd < 0) {
+		request_log("Unable to create source memory: %s\n",
+			    strerror(errno));
+		return -1;
+	}
+
+	/* udmabuf requires the memory not to be shrinkable. */
+	rc = ftruncate(memfd, size);
+	if (rc < 0)
+		goto error;
+
+	rc = fcntl(memfd, F_ADD_SEALS, F_SEAL_SHRINK);
+	if (rc < 0)
+		goto error;
+
+	memset(&udmabuf_create, 0, sizeof(udmabuf_create));
+	udmabuf_create.memfd = memfd;
+	udmabuf_create.flags = UDMABUF_FLAGS_CLOEXEC;
+	udmabuf_create.offset = 0;
+	udmabuf_create.size = size;
+
+	fd = ioctl(context_object->udmabuf_fd, UDMABUF_CREATE,
+		   &udmabuf_create);
+	if (fd < 0)
+		goto error;
+
+	data = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, memfd, 0);
+	if (data == MAP_FAILED) {
+		close(fd);
+		goto error;
+	}
+
+	close(memfd);
+
+	source->data = data;
+	source->size = size;
+	source->fd = fd;
+
+	return 0;
+
+error:
+	request_log("Unable to export source memory: %s\n", strerror(errno));
+	close(memfd);
+
+	return -1;
+}
+
+static void context_source_unmap(struct context_source *source)
+{
+	if (source->data != NULL)
+		munmap(source->data, source->size);
+
+	if (source->fd >= 0)
+		close(source->fd);
+
+	source->data = NULL;
+	source->fd = -1;
+}
+
+static struct context_source *context_source_find(
+	struct object_context *context_object)
+{
+	struct context_source *source;
+	unsigned int i;
+
+	for (i = 0; i < context_object->sources_count; i++) {
+		source = &context_object->sources[i];
+
+		if (!source->busy && source->users == 0 &&
+		    source != context_object->source_fill)
+			return source;
+	}
+
+	return NULL;
+}
+
+struct context_source *context_source_bind(struct request_data *driver_data,
+					   struct object_context *context_object,
+					   unsigned int size,
+					   unsigned int *offset)
+{
+	struct context_source *source;
+
+	pthread_mutex_lock(&driver_data->queue_mutex);
+
+	source = context_object->source_fill;
+	if (source == NULL || source->fill_size + size > source->size) {
+		source = context_source_find(context_object);
+		if (source != NULL)
+			source->fill_size = 0;
+
+		context_object->source_fill = source;
+	}
+
+	if (source == NULL || size > source->size) {
+		source = NULL;
+		goto complete;
+	}
+
+	*offset = source->fill_size;
+	source->fill_size += size;
+	source->users++;
+
+complete:
+	pthread_mutex_unlock(&driver_data->queue_mutex);
+
+	return source;
+}
+
+void context_source_unbind(struct request_data *driver_data,
+			   struct object_context *context_object,
+			   struct context_source *source)
+{
+	pthread_mutex_lock(&driver_data->queue_mutex);
+
+	source->users--;
+
+	/* Start filling again from the beginning once no buffer is left. */
+	if (source->users == 0 && source == context_object->source_fill)
+		source->fill_size = 0;
+
+	pthread_mutex_unlock(&driver_data->queue_mutex);
+}
+
+/*
+ * Take over the given source for a picture when it is available, or any
+ * available one otherwise. Sources are only held by pictures in flight, so
+ * wait for queued requests to be retired until one is given back.
+ */
+struct context_source *context_source_claim(struct request_data *driver_data,
+					    struct object_context *context_object,
+					    struct context_source *source)
+{
+	int rc;
+
+	pthread_mutex_lock(&driver_data->queue_mutex);
+
+	if (source == NULL || source->busy) {
+		source = context_source_find(context_object);
+		while (source == NULL) {
+			rc = surface_request_wait_oldest(driver_data);
+			if (rc < 0)
+				break;
+
+			source = context_source_find(context_object);
+		}
+
+		if (source != NULL)
+			source->fill_size = 0;
+	}
+
+	if (source != NULL) {
+		source->busy = true;
+
+		/* No more slice data can be added to a source in use. */
+		if (source == context_object->source_fill)
+			context_object->source_fill = NULL;
+	}
+
+	pthread_mutex_unlock(&driver_data->queue_mutex);
+
+	return source;
+}
+
+/*
+ * Replace the memory of a source by a larger one, keeping the first bytes of
+ * its data. The source must not be queued nor have slice data buffers
+ * pointing to it. With MMAP memory, a new V4L2 buffer is created and the
+ * previous one cannot be freed individually, so it stays allocated until the
+ * output queue is released.
+ */
+int context_source_grow(struct request_data *driver_data,
+			struct object_context *context_object,
+			struct context_source *source, unsigned int size,
+			unsigned int keep_size)
+{
+	struct video_format *video_format = driver_data->video_format;
+	struct context_source grown;
+	unsigned int output_type;
+	int rc;
+
+	output_type = v4l2_type_video_output(video_format->v4l2_mplane);
+
+	if (size < source->size * 2)
+		size = source->size * 2;
+
+	grown = *source;
+
+	if (source->memory == V4L2_MEMORY_MMAP) {
+		rc = v4l2_create_buffers(driver_data->video_fd, output_type,
+					 V4L2_MEMORY_MMAP, 1, size,
+					 &grown.index, NULL);
+		if (rc < 0)
+			return -1;
+	}
+
+	rc = context_source_map(driver_data, context_object, &grown, size);
+	if (rc < 0)
+		return -1;
+
+	memcpy(grown.data, source->data, keep_size);
+	context_source_unmap(source);
+
+	source->index = grown.index;
+	source->data = grown.data;
+	source->size = grown.size;
+	source->fd = grown.fd;
+
+	return 0;
+}
+
+/* Called with the queue mutex held. */
+void context_source_release(struct context_source *source)
+{
+	source->busy = false;
+}
+
+static void context_sources_destroy(struct request_data *driver_data,
+				    struct object_context *context_object)
+{
+	struct context_source *sources = context_object->sources;
+	struct context_source *sources_end = sources +
+					     context_object->sources_count;
+	struct object_buffer *buffer_object;
+	void *data;
+	int iterator;
+	unsigned int i;
+
+	/* Give buffers still pointing to a source their own copy. */
+	buffer_object = (struct object_buffer *)
+		object_heap_first(&driver_data->buffer_heap, &iterator);
+	while (buffer_object != NULL) {
+		if (buffer_object->source >= sources &&
+		    buffer_object->source < sources_end) {
+			data = buffer_pool_get(&driver_data->buffer_pool,
+					       buffer_object->size *
+					       buffer_object->initial_count);
+			if (data != NULL)
+				memcpy(data, buffer_object->data,
+				       buffer_object->size *
+				       buffer_object->initial_count);
+
+			buffer_object->data = data;
+			buffer_object->source = NULL;
+		}
+
+		buffer_object = (struct object_buffer *)
+			object_heap_next(&driver_data->buffer_heap, &iterator);
+	}
+
+	for (i = 0; i < context_object->sources_count; i++)
+		context_source_unmap(&sources[i]);
+
+	free(sources);
+
+	if (context_object->udmabuf_fd >= 0)
+		close(context_object->udmabuf_fd);
+
+	context_object->sources = NULL;
+	context_object->sources_count = 0;
+	context_object->source_fill = NULL;
+	context_object->udmabuf_fd = -1;
+}
+
 VAStatus RequestCreateContext(VADriverContextP context, VAConfigID config_id,
 			      int picture_width, int picture_height, int flags,
 			      VASurfaceID *surfaces_ids, int surfaces_count,
@@ -53,16 +394,21 @@ VAStatus RequestCreateContext(VADriverContextP context, VAConfigID config_id,
 	struct object_surface *surface_object;
 	struct object_context *context_object = NULL;
 	struct video_format *video_format;
-	unsigned int length;
-	unsigned int offset;
-	void *source_data = MAP_FAILED;
+	struct context_source *sources = NULL;
+	char *pipeline_depth_env;
+	char *output_memory;
+	unsigned int pipeline_depth;
+	unsigned int sources_count;
+	unsigned int buffers_count;
+	unsigned int source_size;
+	unsigned int memory;
 	VASurfaceID *ids = NULL;
 	VAContextID id;
 	VAStatus status;
 	unsigned int output_type, capture_type;
 	unsigned int pixelformat;
+	unsigned int capabilities;
 	unsigned int index_base;
-	unsigned int index;
 	unsigned int i;
 	int rc;
 
@@ -86,6 +432,7 @@ VAStatus RequestCreateContext(VADriverContextP context, VAConfigID config_id,
 		goto error;
 	}
 	memset(&context_object->dpb, 0, sizeof(context_object->dpb));
+	context_object->udmabuf_fd = -1;
 
 	switch (config_object->profile) {
 
@@ -117,15 +464,67 @@ VAStatus RequestCreateContext(VADriverContextP context, VAConfigID config_id,
 		goto error;
 	}
 
+	source_size = context_source_size(pixelformat, picture_width,
+					  picture_height);
+
 	rc = v4l2_set_format(driver_data->video_fd, output_type, pixelformat,
-			     picture_width, picture_height);
+			     picture_width, picture_height, source_size);
 	if (rc < 0) {
 		status = VA_STATUS_ERROR_OPERATION_FAILED;
 		goto error;
 	}
 
-	rc = v4l2_create_buffers(driver_data->video_fd, output_type,
-				 surfaces_count, &index_base);
+	pipeline_depth = V4L2_REQUEST_PIPELINE_DEPTH;
+
+	pipeline_depth_env = getenv("LIBVA_V4L2_REQUEST_PIPELINE_DEPTH");
+	if (pipeline_depth_env != NULL && atoi(pipeline_depth_env) > 0)
+		pipeline_depth = atoi(pipeline_depth_env);
+
+	/*
+	 * Output buffers are only held while a picture is prepared or in
+	 * flight, so size the pool after the pipeline rather than the render
+	 * targets: one source per queued request, one for the picture being
+	 * prepared and one for slice data written ahead of it.
+	 */
+	sources_count = pipeline_depth + 2;
+
+	/*
+	 * Sources can be backed by our own memory, exported as DMABUF, instead
+	 * of V4L2 buffers when asked to. This requires udmabuf and a device
+	 * that can access scattered memory.
+	 */
+	memory = V4L2_MEMORY_MMAP;
+
+	output_memory = getenv("LIBVA_V4L2_REQUEST_OUTPUT_MEMORY");
+	if (output_memory != NULL && strcmp(output_memory, "dmabuf") == 0) {
+		context_object->udmabuf_fd = open("/dev/udmabuf",
+						  O_RDWR | O_CLOEXEC);
+		if (context_object->udmabuf_fd >= 0)
+			memory = V4L2_MEMORY_DMABUF;
+		else
+			request_log("Unable to open udmabuf: %s\n",
+				    strerror(errno));
+	}
+
+	/* DMABUF memory is probed with an extra buffer, never used after. */
+	buffers_count = sources_count;
+	if (memory == V4L2_MEMORY_DMABUF)
+		buffers_count++;
+
+	rc = v4l2_create_buffers(driver_data->video_fd, output_type, memory,
+				 buffers_count, 0, &index_base, &capabilities);
+	if (rc < 0 && memory == V4L2_MEMORY_DMABUF) {
+		request_log("Unable to use DMABUF sources, falling back to MMAP\n");
+
+		close(context_object->udmabuf_fd);
+		context_object->udmabuf_fd = -1;
+
+		memory = V4L2_MEMORY_MMAP;
+		rc = v4l2_create_buffers(driver_data->video_fd, output_type,
+					 memory, sources_count, 0, &index_base,
+					 &capabilities);
+	}
+
 	if (rc < 0) {
 		status = VA_STATUS_ERROR_ALLOCATION_FAILED;
 		goto error;
@@ -145,31 +544,51 @@ VAStatus RequestCreateContext(VADriverContextP context, VAConfigID config_id,
 	memcpy(ids, surfaces_ids, surfaces_count * sizeof(VASurfaceID));
 
 	for (i = 0; i < surfaces_count; i++) {
-		index = index_base + i;
-
 		surface_object = SURFACE(driver_data, surfaces_ids[i]);
 		if (surface_object == NULL) {
 			status = VA_STATUS_ERROR_INVALID_SURFACE;
 			goto error;
 		}
+	}
 
-		rc = v4l2_query_buffer(driver_data->video_fd, output_type,
-				       index, &length, &offset, 1);
+	sources = calloc(sources_count, sizeof(*sources));
+	if (sources == NULL) {
+		status = VA_STATUS_ERROR_ALLOCATION_FAILED;
+		goto error;
+	}
+
+	for (i = 0; i < sources_count; i++) {
+		sources[i].index = index_base + i;
+		sources[i].memory = memory;
+		sources[i].fd = -1;
+	}
+
+	for (i = 0; i < sources_count; i++) {
+		rc = context_source_map(driver_data, context_object,
+					&sources[i], source_size);
 		if (rc < 0) {
 			status = VA_STATUS_ERROR_ALLOCATION_FAILED;
 			goto error;
 		}
+	}
 
-		source_data = mmap(NULL, length, PROT_READ | PROT_WRITE,
-				   MAP_SHARED, driver_data->video_fd, offset);
-		if (source_data == MAP_FAILED) {
-			status = VA_STATUS_ERROR_ALLOCATION_FAILED;
+	/*
+	 * Devices that need contiguous memory accept DMABUF buffers but only
+	 * reject scattered udmabuf memory when it is attached. The buffers
+	 * are already created at this point, so fail instead of falling back.
+	 * A prepared buffer skips preparation when queued later on, with its
+	 * size left as prepared, so the memory of a source is attached to the
+	 * extra buffer instead.
+	 */
+	if (memory == V4L2_MEMORY_DMABUF) {
+		rc = v4l2_prepare_buffer(driver_data->video_fd, output_type,
+					 memory, index_base + sources_count,
+					 &sources[0].fd, sources[0].size, 1);
+		if (rc < 0) {
+			request_log("Device cannot access udmabuf sources, unset LIBVA_V4L2_REQUEST_OUTPUT_MEMORY\n");
+			status = VA_STATUS_ERROR_OPERATION_FAILED;
 			goto error;
 		}
-
-		surface_object->source_index = index;
-		surface_object->source_data = source_data;
-		surface_object->source_size = length;
 	}
 
 	rc = v4l2_set_stream(driver_data->video_fd, output_type, true);
@@ -192,14 +611,53 @@ VAStatus RequestCreateContext(VADriverContextP context, VAConfigID config_id,
 	context_object->picture_height = picture_height;
 	context_object->flags = flags;
 
+	context_object->sources = sources;
+	context_object->sources_count = sources_count;
+	context_object->source_fill = NULL;
+
+	context_object->h264_slice_params = NULL;
+	context_object->h264_slice_params_count = 0;
+
+	/*
+	 * Slices are submitted in their own request as soon as they are
+	 * rendered when asked to and when the driver can hold the capture
+	 * buffer across requests.
+	 */
+	context_object->slice_mode =
+		pixelformat == V4L2_PIX_FMT_H264_SLICE &&
+		(capabilities & V4L2_BUF_CAP_SUPPORTS_M2M_HOLD_CAPTURE_BUF) &&
+		getenv("LIBVA_V4L2_REQUEST_SLICE_MODE") != NULL;
+
+	context_object->pipeline_depth = pipeline_depth;
+	context_object->queued_count = 0;
+
+	v4l2_control_cache_invalidate(&driver_data->control_cache);
+
+	/*
+	 * One more request is prepared while the pipeline is full. Requests
+	 * are allocated on demand if the reservation falls short.
+	 */
+	pthread_mutex_lock(&driver_data->queue_mutex);
+	media_request_pool_reserve(&driver_data->request_pool,
+				   driver_data->media_fd,
+				   pipeline_depth + 1);
+	pthread_mutex_unlock(&driver_data->queue_mutex);
+
 	*context_id = id;
 
 	status = VA_STATUS_SUCCESS;
 	goto complete;
 
 error:
-	if (source_data != MAP_FAILED)
-		munmap(source_data, length);
+	if (sources != NULL) {
+		for (i = 0; i < sources_count; i++)
+			context_source_unmap(&sources[i]);
+
+		free(sources);
+	}
+
+	if (context_object != NULL && context_object->udmabuf_fd >= 0)
+		close(context_object->udmabuf_fd);
 
 	if (ids != NULL)
 		free(ids);
@@ -232,6 +690,12 @@ VAStatus RequestDestroyContext(VADriverContextP context, VAContextID context_id)
 	if (context_object == NULL)
 		return VA_STATUS_ERROR_INVALID_CONTEXT;
 
+	/*
+	 * Let the requests still in flight complete before streaming off,
+	 * including those of other contexts since the queues are shared.
+	 */
+	surface_request_drain(driver_data);
+
 	rc = v4l2_set_stream(driver_data->video_fd, output_type, false);
 	if (rc < 0)
 		return VA_STATUS_ERROR_OPERATION_FAILED;
@@ -249,6 +713,11 @@ VAStatus RequestDestroyContext(VADriverContextP context, VAContextID context_id)
 
 	free(context_object->surfaces_ids);
 
+	context_sources_destroy(driver_data, context_object);
+
+	if (context_object->h264_slice_params != NULL)
+		free(context_object->h264_slice_params);
+
 	object_heap_free(&driver_data->context_heap,
 			 (struct object_base *)context_object);
 
@@ -26,6 +26,10 @@
 #ifndef _CONTEXT_H_
 #define _CONTEXT_H_
 
+#include <stdbool.h>
+
+#include <linux/videodev2.h>
+
 #include <va/va_backend.h>
 
 #include "object_heap.h"
@@ -35,6 +39,30 @@
 	((struct object_context *)object_heap_lookup(&(data)->context_heap, id))
 #define CONTEXT_ID_OFFSET		0x02000000
 
+struct request_data;
+
+/*
+ * V4L2 output buffer holding the bitstream of a picture. Slice data buffers
+ * are carved out of the fill source when created and a picture takes over
+ * the source its first slice was written to, so that slice data does not
+ * need to be copied when buffers are rendered in creation order.
+ */
+struct context_source {
+	unsigned int index;
+	unsigned int memory;
+	void *data;
+	unsigned int size;
+	/* DMABUF memory only */
+	int fd;
+
+	/* Bytes handed out to slice data buffers. */
+	unsigned int fill_size;
+	/* Slice data buffers pointing to the source. */
+	unsigned int users;
+	/* Owned by a picture until its request completes. */
+	bool busy;
+};
+
 struct object_context {
 	struct object_base base;
 
@@ -47,10 +75,39 @@ struct object_context {
 	int picture_height;
 	int flags;
 
+	unsigned int pipeline_depth;
+	/* Requests in flight, protected by the driver queue mutex. */
+	unsigned int queued_count;
+	bool slice_mode;
+
+	struct context_source *sources;
+	unsigned int sources_count;
+	struct context_source *source_fill;
+	int udmabuf_fd;
+
 	/* H264 only */
 	struct h264_dpb dpb;
+	struct v4l2_ctrl_h264_slice_param *h264_slice_params;
+	unsigned int h264_slice_params_count;
+	struct v4l2_ctrl_h264_decode_param h264_decode;
 };
 
+struct context_source *context_source_bind(struct request_data *driver_data,
+					   struct object_context *context_object,
+					   unsigned int size,
+					   unsigned int *offset);
+void context_source_unbind(struct request_data *driver_data,
+			   struct object_context *context_object,
+			   struct context_source *source);
+struct context_source *context_source_claim(struct request_data *driver_data,
+					    struct object_context *context_object,
+					    struct context_source *source);
+int context_source_grow(struct request_data *driver_data,
+			struct object_context *context_object,
+			struct context_source *source, unsigned int size,
+			unsigned int keep_size);
+void context_source_release(struct context_source *source);
+
 VAStatus RequestCreateContext(VADriverContextP context, VAConfigID config_id,
 			      int picture_width, int picture_height, int flags,
 			      VASurfaceID *surfaces_ids, int surfaces_count,
@@ -26,6 +26,7 @@
 
 #include <assert.h>
 #include <limits.h>
+#include <stdlib.h>
 #include <string.h>
 
 #include <sys/ioctl.h>
@@ -35,6 +36,7 @@
 
 #include "request.h"
 #include "surface.h"
+#include "utils.h"
 #include "v4l2.h"
 
 enum h264_slice_type {
@@ -215,7 +217,6 @@ static void h264_va_picture_to_v4l2(struct request_data *driver_data,
 {
 	h264_fill_dpb(driver_data, context, decode);
 
-	decode->num_slices = surface->slices_count;
 	decode->top_field_order_cnt = VAPicture->CurrPic.TopFieldOrderCnt;
 	decode->bottom_field_order_cnt = VAPicture->CurrPic.BottomFieldOrderCnt;
 
@@ -406,59 +407,135 @@ int h264_set_controls(struct request_data *driver_data,
 {
 	struct v4l2_ctrl_h264_scaling_matrix matrix = { 0 };
 	struct v4l2_ctrl_h264_decode_param decode = { 0 };
-	struct v4l2_ctrl_h264_slice_param slice = { 0 };
 	struct v4l2_ctrl_h264_pps pps = { 0 };
 	struct v4l2_ctrl_h264_sps sps = { 0 };
-	struct h264_dpb_entry *output;
+	struct v4l2_ext_control controls[5] = { 0 };
+	VAPictureParameterBufferH264 *picture = surface->picture_buffer->data;
+	VASliceParameterBufferH264 *slice_params;
+	struct object_buffer *buffer_object;
+	struct h264_dpb_entry *output = NULL;
+	unsigned int first_slice;
+	unsigned int slices_count;
+	unsigned int elems;
+	unsigned int index;
+	unsigned int i, j, k;
 	int rc;
 
-	output = dpb_lookup(context, &surface->params.h264.picture.CurrPic,
-			    NULL);
-	if (!output)
-		output = dpb_find_entry(context);
+	/*
+	 * The slice parameters control is an array whose size is fixed by
+	 * the driver and that is always submitted whole.
+	 */
+	if (context->h264_slice_params == NULL) {
+		rc = v4l2_query_control(driver_data->video_fd,
+					V4L2_CID_MPEG_VIDEO_H264_SLICE_PARAMS,
+					&elems);
+		if (rc < 0)
+			return VA_STATUS_ERROR_OPERATION_FAILED;
+
+		context->h264_slice_params =
+			malloc(elems * sizeof(*context->h264_slice_params));
+		if (context->h264_slice_params == NULL)
+			return VA_STATUS_ERROR_ALLOCATION_FAILED;
+
+		context->h264_slice_params_count = elems;
+	}
+
+	/* In slice mode, only the slices rendered since the last request. */
+	first_slice = surface->slice_params_submitted;
+	slices_count = surface->slice_params_count - first_slice;
+	if (slices_count > context->h264_slice_params_count) {
+		request_log("Unable to submit %u slices, the driver supports %u\n",
+			    slices_count, context->h264_slice_params_count);
+		return VA_STATUS_ERROR_MAX_NUM_EXCEEDED;
+	}
+
+	if (first_slice == 0) {
+		output = dpb_lookup(context, &picture->CurrPic, NULL);
+		if (!output)
+			output = dpb_find_entry(context);
 
-	dpb_clear_entry(output, true);
+		dpb_clear_entry(output, true);
 
-	dpb_update(context, &surface->params.h264.picture);
+		dpb_update(context, picture);
+	}
 
-	h264_va_picture_to_v4l2(driver_data, context, surface,
-				&surface->params.h264.picture,
+	h264_va_picture_to_v4l2(driver_data, context, surface, picture,
 				&decode, &pps, &sps);
-	h264_va_matrix_to_v4l2(driver_data, context,
-			       &surface->params.h264.matrix, &matrix);
-	h264_va_slice_to_v4l2(driver_data, context,
-			      &surface->params.h264.slice,
-			      &surface->params.h264.picture, &slice);
-
-	rc = v4l2_set_control(driver_data->video_fd, surface->request_fd,
-			      V4L2_CID_MPEG_VIDEO_H264_DECODE_PARAMS, &decode,
-			      sizeof(decode));
-	if (rc < 0)
-		return VA_STATUS_ERROR_OPERATION_FAILED;
 
-	rc = v4l2_set_control(driver_data->video_fd, surface->request_fd,
-			      V4L2_CID_MPEG_VIDEO_H264_SLICE_PARAMS, &slice,
-			      sizeof(slice));
-	if (rc < 0)
-		return VA_STATUS_ERROR_OPERATION_FAILED;
+	/* Pictures rendered without a matrix use the flat default. */
+	if (surface->matrix_buffer != NULL) {
+		h264_va_matrix_to_v4l2(driver_data, context,
+				       surface->matrix_buffer->data, &matrix);
+	} else {
+		memset(matrix.scaling_list_4x4, 16,
+		       sizeof(matrix.scaling_list_4x4));
+		memset(matrix.scaling_list_8x8, 16,
+		       sizeof(matrix.scaling_list_8x8));
+	}
 
-	rc = v4l2_set_control(driver_data->video_fd, surface->request_fd,
-			      V4L2_CID_MPEG_VIDEO_H264_PPS, &pps, sizeof(pps));
-	if (rc < 0)
-		return VA_STATUS_ERROR_OPERATION_FAILED;
+	/*
+	 * The current picture is already in the DPB for the following slices
+	 * of the picture, so keep the decode parameters of the first one.
+	 */
+	if (first_slice == 0)
+		context->h264_decode = decode;
+	else
+		decode = context->h264_decode;
 
-	rc = v4l2_set_control(driver_data->video_fd, surface->request_fd,
-			      V4L2_CID_MPEG_VIDEO_H264_SPS, &sps, sizeof(sps));
-	if (rc < 0)
-		return VA_STATUS_ERROR_OPERATION_FAILED;
+	decode.num_slices = slices_count;
+
+	memset(context->h264_slice_params, 0,
+	       context->h264_slice_params_count *
+	       sizeof(*context->h264_slice_params));
+
+	/* Slices are read from the parameter buffers in rendering order. */
+	i = 0;
+	index = 0;
+
+	for (j = 0; j < surface->slice_buffers_count && i < slices_count; j++) {
+		buffer_object = surface->slice_buffers[j];
+		slice_params = buffer_object->data;
+
+		for (k = 0; k < buffer_object->count && i < slices_count; k++) {
+			if (index++ < first_slice)
+				continue;
+
+			h264_va_slice_to_v4l2(driver_data, context,
+					      &slice_params[k], picture,
+					      &context->h264_slice_params[i++]);
+		}
+	}
+
+	controls[0].id = V4L2_CID_MPEG_VIDEO_H264_DECODE_PARAMS;
+	controls[0].ptr = &decode;
+	controls[0].size = sizeof(decode);
+
+	controls[1].id = V4L2_CID_MPEG_VIDEO_H264_SLICE_PARAMS;
+	controls[1].ptr = context->h264_slice_params;
+	controls[1].size = context->h264_slice_params_count *
+			   sizeof(*context->h264_slice_params);
+
+	controls[2].id = V4L2_CID_MPEG_VIDEO_H264_PPS;
+	controls[2].ptr = &pps;
+	controls[2].size = sizeof(pps);
+
+	controls[3].id = V4L2_CID_MPEG_VIDEO_H264_SPS;
+	controls[3].ptr = &sps;
+	controls[3].size = sizeof(sps);
+
+	controls[4].id = V4L2_CID_MPEG_VIDEO_H264_SCALING_MATRIX;
+	controls[4].ptr = &matrix;
+	controls[4].size = sizeof(matrix);
 
-	rc = v4l2_set_control(driver_data->video_fd, surface->request_fd,
-			      V4L2_CID_MPEG_VIDEO_H264_SCALING_MATRIX, &matrix,
-			      sizeof(matrix));
+	rc = v4l2_set_controls_cached(driver_data->video_fd,
+				      surface->request_fd,
+				      &driver_data->control_cache, controls,
+				      5);
 	if (rc < 0)
 		return VA_STATUS_ERROR_OPERATION_FAILED;
 
-	dpb_insert(context, &surface->params.h264.picture.CurrPic, output);
+	if (first_slice == 0)
+		dpb_insert(context, &picture->CurrPic, output);
 
 	return VA_STATUS_SUCCESS;
 }
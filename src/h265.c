@@ -364,38 +364,42 @@ int h265_set_controls(struct request_data *driver_data,
 		      struct object_context *context_object,
 		      struct object_surface *surface_object)
 {
+	struct object_buffer *matrix_buffer = surface_object->matrix_buffer;
+	unsigned int slice_index = surface_object->slice_buffers_count - 1;
 	VAPictureParameterBufferHEVC *picture =
-		&surface_object->params.h265.picture;
+		surface_object->picture_buffer->data;
 	VASliceParameterBufferHEVC *slice =
-		&surface_object->params.h265.slice;
+		surface_object->slice_buffers[slice_index]->data;
 	VAIQMatrixBufferHEVC *iqmatrix =
-		&surface_object->params.h265.iqmatrix;
-	bool iqmatrix_set = surface_object->params.h265.iqmatrix_set;
+		matrix_buffer != NULL ? matrix_buffer->data : NULL;
+	bool iqmatrix_set = matrix_buffer != NULL;
 	struct v4l2_ctrl_hevc_pps pps;
 	struct v4l2_ctrl_hevc_sps sps;
 	struct v4l2_ctrl_hevc_slice_params slice_params;
+	struct v4l2_ext_control controls[3] = { 0 };
 	int rc;
 
 	h265_fill_pps(picture, slice, &pps);
-
-	rc = v4l2_set_control(driver_data->video_fd, surface_object->request_fd,
-			      V4L2_CID_MPEG_VIDEO_HEVC_PPS, &pps, sizeof(pps));
-	if (rc < 0)
-		return VA_STATUS_ERROR_OPERATION_FAILED;
-
 	h265_fill_sps(picture, &sps);
+	h265_fill_slice_params(picture, slice, &driver_data->surface_heap,
+			       surface_object->source->data, &slice_params);
 
-	rc = v4l2_set_control(driver_data->video_fd, surface_object->request_fd,
-			      V4L2_CID_MPEG_VIDEO_HEVC_SPS, &sps, sizeof(sps));
-	if (rc < 0)
-		return VA_STATUS_ERROR_OPERATION_FAILED;
+	controls[0].id = V4L2_CID_MPEG_VIDEO_HEVC_PPS;
+	controls[0].ptr = &pps;
+	controls[0].size = sizeof(pps);
 
-	h265_fill_slice_params(picture, slice, &driver_data->surface_heap,
-			       surface_object->source_data, &slice_params);
+	controls[1].id = V4L2_CID_MPEG_VIDEO_HEVC_SPS;
+	controls[1].ptr = &sps;
+	controls[1].size = sizeof(sps);
+
+	controls[2].id = V4L2_CID_MPEG_VIDEO_HEVC_SLICE_PARAMS;
+	controls[2].ptr = &slice_params;
+	controls[2].size = sizeof(slice_params);
 
-	rc = v4l2_set_control(driver_data->video_fd, surface_object->request_fd,
-			      V4L2_CID_MPEG_VIDEO_HEVC_SLICE_PARAMS,
-			      &slice_params, sizeof(slice_params));
+	rc = v4l2_set_controls_cached(driver_data->video_fd,
+				      surface_object->request_fd,
+				      &driver_data->control_cache, controls,
+				      3);
 	if (rc < 0)
 		return VA_STATUS_ERROR_OPERATION_FAILED;
 
@@ -30,12 +30,306 @@
 #include "video.h"
 
 #include <assert.h>
+#include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
+
+#include <sys/mman.h>
+
+#include <linux/dma-buf.h>
 
 #include "tiled_yuv.h"
 #include "utils.h"
 #include "v4l2.h"
 
+#define IMAGE_HUGE_PAGE_SIZE		(2 * 1024 * 1024)
+#define IMAGE_WORKERS_DEFAULT		4
+
+/*
+ * Large images are aligned to huge pages so that transparent huge pages can
+ * back them, which spares TLB misses when frames are copied.
+ */
+static void *image_data_allocate(unsigned int size)
+{
+	void *data;
+	int rc;
+
+	if (size < IMAGE_HUGE_PAGE_SIZE)
+		return malloc(size);
+
+	size = (size + IMAGE_HUGE_PAGE_SIZE - 1) / IMAGE_HUGE_PAGE_SIZE *
+	       IMAGE_HUGE_PAGE_SIZE;
+
+	rc = posix_memalign(&data, IMAGE_HUGE_PAGE_SIZE, size);
+	if (rc != 0)
+		return NULL;
+
+	madvise(data, size, MADV_HUGEPAGE);
+
+	return data;
+}
+
+void image_pool_init(struct image_pool *pool)
+{
+	pthread_mutex_init(&pool->mutex, NULL);
+}
+
+void *image_pool_get(struct image_pool *pool, unsigned int size)
+{
+	void *data = NULL;
+	unsigned int i;
+
+	pthread_mutex_lock(&pool->mutex);
+
+	for (i = 0; i < pool->entries_count; i++) {
+		if (pool->entries[i].size != size)
+			continue;
+
+		data = pool->entries[i].data;
+
+		pool->entries_count--;
+		pool->entries[i] = pool->entries[pool->entries_count];
+		break;
+	}
+
+	pthread_mutex_unlock(&pool->mutex);
+
+	if (data == NULL)
+		data = image_data_allocate(size);
+
+	return data;
+}
+
+void image_pool_put(struct image_pool *pool, void *data, unsigned int size)
+{
+	void *stale_data = NULL;
+
+	pthread_mutex_lock(&pool->mutex);
+
+	/* Make room by dropping the oldest entry, likely of a stale size. */
+	if (pool->entries_count == IMAGE_POOL_SIZE) {
+		stale_data = pool->entries[0].data;
+
+		pool->entries_count--;
+		memmove(&pool->entries[0], &pool->entries[1],
+			pool->entries_count * sizeof(pool->entries[0]));
+	}
+
+	pool->entries[pool->entries_count].data = data;
+	pool->entries[pool->entries_count].size = size;
+	pool->entries_count++;
+
+	pthread_mutex_unlock(&pool->mutex);
+
+	free(stale_data);
+}
+
+void image_pool_destroy(struct image_pool *pool)
+{
+	unsigned int i;
+
+	for (i = 0; i < pool->entries_count; i++)
+		free(pool->entries[i].data);
+
+	pool->entries_count = 0;
+
+	pthread_mutex_destroy(&pool->mutex);
+}
+
+static void image_copy_band(struct image_copy *copy, unsigned int band)
+{
+	unsigned int tiles_stride;
+	unsigned int offset;
+	unsigned int rows;
+	unsigned int size;
+
+	if (copy->tiled) {
+		tiles_stride = (copy->width + 31) / 32 * 32 * 32;
+		offset = band * copy->band_rows;
+
+		rows = copy->height - offset;
+		if (rows > copy->band_rows)
+			rows = copy->band_rows;
+
+		tiled_to_planar(copy->src + offset / 32 * tiles_stride,
+				copy->dst + offset * copy->pitch, copy->pitch,
+				copy->width, rows);
+	} else {
+		offset = band * copy->band_size;
+
+		size = copy->size - offset;
+		if (size > copy->band_size)
+			size = copy->band_size;
+
+		linear_to_planar(copy->src + offset, copy->dst + offset,
+				 size);
+	}
+}
+
+/* Called with the workers mutex held, released while copying. */
+static void image_copy_work(struct image_workers *workers,
+			    struct image_copy *copy)
+{
+	unsigned int band;
+
+	while (copy->bands_next < copy->bands_count) {
+		band = copy->bands_next++;
+
+		pthread_mutex_unlock(&workers->mutex);
+		image_copy_band(copy, band);
+		pthread_mutex_lock(&workers->mutex);
+
+		copy->bands_done++;
+		if (copy->bands_done == copy->bands_count)
+			pthread_cond_broadcast(&workers->done_cond);
+	}
+}
+
+static void *image_worker(void *data)
+{
+	struct image_workers *workers = data;
+
+	pthread_mutex_lock(&workers->mutex);
+
+	while (!workers->stop) {
+		if (workers->copy != NULL &&
+		    workers->copy->bands_next < workers->copy->bands_count)
+			image_copy_work(workers, workers->copy);
+		else
+			pthread_cond_wait(&workers->work_cond,
+					  &workers->mutex);
+	}
+
+	pthread_mutex_unlock(&workers->mutex);
+
+	return NULL;
+}
+
+/*
+ * Start the threads helping with image copies: one per online CPU up to 4 by
+ * default, counting the calling thread. No thread is started when a single
+ * one is asked for.
+ */
+void image_workers_start(struct image_workers *workers)
+{
+	char *threads_count_env;
+	unsigned int threads_count;
+	long cpus_count;
+	unsigned int i;
+	int rc;
+
+	pthread_mutex_init(&workers->mutex, NULL);
+	pthread_cond_init(&workers->work_cond, NULL);
+	pthread_cond_init(&workers->done_cond, NULL);
+	workers->copy = NULL;
+	workers->stop = false;
+	workers->threads = NULL;
+	workers->threads_count = 0;
+
+	cpus_count = sysconf(_SC_NPROCESSORS_ONLN);
+	threads_count = cpus_count > 0 ? cpus_count : 1;
+	if (threads_count > IMAGE_WORKERS_DEFAULT)
+		threads_count = IMAGE_WORKERS_DEFAULT;
+
+	threads_count_env = getenv("LIBVA_V4L2_REQUEST_COPY_THREADS");
+	if (threads_count_env != NULL && atoi(threads_count_env) > 0)
+		threads_count = atoi(threads_count_env);
+
+	if (threads_count <= 1)
+		return;
+
+	workers->threads = calloc(threads_count - 1,
+				  sizeof(*workers->threads));
+	if (workers->threads == NULL)
+		return;
+
+	for (i = 0; i < threads_count - 1; i++) {
+		rc = pthread_create(&workers->threads[i], NULL, image_worker,
+				    workers);
+		if (rc != 0) {
+			request_log("Unable to start image worker: %s\n",
+				    strerror(rc));
+			break;
+		}
+
+		workers->threads_count++;
+	}
+}
+
+void image_workers_stop(struct image_workers *workers)
+{
+	unsigned int i;
+
+	pthread_mutex_lock(&workers->mutex);
+	workers->stop = true;
+	pthread_cond_broadcast(&workers->work_cond);
+	pthread_mutex_unlock(&workers->mutex);
+
+	for (i = 0; i < workers->threads_count; i++)
+		pthread_join(workers->threads[i], NULL);
+
+	free(workers->threads);
+
+	pthread_cond_destroy(&workers->done_cond);
+	pthread_cond_destroy(&workers->work_cond);
+	pthread_mutex_destroy(&workers->mutex);
+}
+
+/*
+ * Copy a plane with the help of the workers, splitting it in one band per
+ * thread. Tiled bands are made of whole rows of tiles.
+ */
+static void image_copy_plane(struct image_workers *workers,
+			     struct image_copy *copy)
+{
+	unsigned int threads_count = workers->threads_count + 1;
+	unsigned int page_size = getpagesize();
+	unsigned int rows;
+
+	if (copy->tiled) {
+		rows = (copy->height + threads_count - 1) / threads_count;
+		copy->band_rows = (rows + 31) / 32 * 32;
+		copy->bands_count = (copy->height + copy->band_rows - 1) /
+				    copy->band_rows;
+	} else {
+		copy->band_size = (copy->size + threads_count - 1) /
+				  threads_count;
+		copy->band_size = (copy->band_size + page_size - 1) /
+				  page_size * page_size;
+		copy->bands_count = (copy->size + copy->band_size - 1) /
+				    copy->band_size;
+	}
+
+	copy->bands_next = 0;
+	copy->bands_done = 0;
+
+	if (copy->bands_count <= 1 || workers->threads_count == 0) {
+		for (; copy->bands_next < copy->bands_count; copy->bands_next++)
+			image_copy_band(copy, copy->bands_next);
+
+		return;
+	}
+
+	pthread_mutex_lock(&workers->mutex);
+
+	/* Only one copy is shared with the workers at a time. */
+	while (workers->copy != NULL)
+		pthread_cond_wait(&workers->done_cond, &workers->mutex);
+
+	workers->copy = copy;
+	pthread_cond_broadcast(&workers->work_cond);
+
+	image_copy_work(workers, copy);
+
+	while (copy->bands_done < copy->bands_count)
+		pthread_cond_wait(&workers->done_cond, &workers->mutex);
+
+	workers->copy = NULL;
+	pthread_cond_broadcast(&workers->done_cond);
+
+	pthread_mutex_unlock(&workers->mutex);
+}
+
 VAStatus RequestCreateImage(VADriverContextP context, VAImageFormat *format,
 			    int width, int height, VAImage *image)
 {
@@ -142,15 +436,85 @@ VAStatus RequestDestroyImage(VADriverContextP context, VAImageID image_id)
 	return VA_STATUS_SUCCESS;
 }
 
+/*
+ * Derive an image that points to the surface mapping, which is possible when
+ * the surface is linear and held in a single buffer.
+ */
+static VAStatus image_derive_alias(struct request_data *driver_data,
+				   struct object_surface *surface_object,
+				   VAImage *image)
+{
+	struct object_image *image_object;
+	struct object_buffer *buffer_object;
+	VABufferID buffer_id;
+	VAImageID id;
+	unsigned int i;
+
+	id = object_heap_allocate(&driver_data->image_heap);
+	image_object = IMAGE(driver_data, id);
+	if (image_object == NULL)
+		return VA_STATUS_ERROR_ALLOCATION_FAILED;
+
+	buffer_id = object_heap_allocate(&driver_data->buffer_heap);
+	buffer_object = BUFFER(driver_data, buffer_id);
+	if (buffer_object == NULL) {
+		object_heap_free(&driver_data->image_heap,
+				 (struct object_base *)image_object);
+		return VA_STATUS_ERROR_ALLOCATION_FAILED;
+	}
+
+	buffer_object->type = VAImageBufferType;
+	buffer_object->initial_count = 1;
+	buffer_object->count = 1;
+	buffer_object->data = surface_object->destination_map[0];
+	buffer_object->size = surface_object->destination_map_lengths[0];
+
+	buffer_object->context_id = VA_INVALID_ID;
+	buffer_object->source = NULL;
+	buffer_object->source_offset = 0;
+
+	buffer_object->derived_surface_id = surface_object->base.id;
+	buffer_object->derived_alias = true;
+	buffer_object->references = 1;
+	buffer_object->destroyed = false;
+	buffer_object->info.handle = (uintptr_t) -1;
+
+	/* Access ends when the image buffer is destroyed. */
+	surface_sync(surface_object, DMA_BUF_SYNC_START | DMA_BUF_SYNC_RW);
+
+	memset(image, 0, sizeof(*image));
+
+	image->format.fourcc = VA_FOURCC_NV12;
+	image->width = surface_object->width;
+	image->height = surface_object->height;
+	image->buf = buffer_id;
+	image->image_id = id;
+
+	image->num_planes = surface_object->destination_planes_count;
+	image->data_size = buffer_object->size;
+
+	for (i = 0; i < image->num_planes; i++) {
+		image->pitches[i] =
+			surface_object->destination_bytesperlines[i];
+		image->offsets[i] = surface_object->destination_offsets[i];
+	}
+
+	image_object->image = *image;
+
+	return VA_STATUS_SUCCESS;
+}
+
 VAStatus RequestDeriveImage(VADriverContextP context, VASurfaceID surface_id,
 			    VAImage *image)
 {
 	struct request_data *driver_data = context->pDriverData;
 	struct object_surface *surface_object;
 	struct object_buffer *buffer_object;
+	struct image_copy copy;
 	VAImageFormat format;
 	unsigned int i;
 	VAStatus status;
+	int rc;
 
 	surface_object = SURFACE(driver_data, surface_id);
 	if (surface_object == NULL)
@@ -162,36 +526,66 @@ VAStatus RequestDeriveImage(VADriverContextP context, VASurfaceID surface_id,
 			return status;
 	}
 
+	rc = surface_map(driver_data, surface_object);
+	if (rc < 0)
+		return VA_STATUS_ERROR_OPERATION_FAILED;
+
+	/* Only tiled or scattered surfaces have to be copied. */
+	if (video_format_is_linear(driver_data->video_format) &&
+	    surface_object->destination_buffers_count == 1) {
+		/* The image keeps the mapping pinned until destroyed. */
+		status = image_derive_alias(driver_data, surface_object,
+					    image);
+		if (status != VA_STATUS_SUCCESS) {
+			surface_map_release(driver_data, surface_object);
+			return status;
+		}
+
+		surface_object->status = VASurfaceReady;
+
+		return VA_STATUS_SUCCESS;
+	}
+
 	format.fourcc = VA_FOURCC_NV12;
 
 	status = RequestCreateImage(context, &format, surface_object->width,
 				    surface_object->height, image);
 	if (status != VA_STATUS_SUCCESS)
-		return status;
+		goto complete;
 
 	buffer_object = BUFFER(driver_data, image->buf);
-	if (buffer_object == NULL)
-		return VA_STATUS_ERROR_INVALID_BUFFER;
+	if (buffer_object == NULL) {
+		status = VA_STATUS_ERROR_INVALID_BUFFER;
+		goto complete;
+	}
+
+	surface_sync(surface_object, DMA_BUF_SYNC_START | DMA_BUF_SYNC_READ);
 
 	for (i = 0; i < surface_object->destination_planes_count; i++) {
-		if (!video_format_is_linear(driver_data->video_format))
-			tiled_to_planar(surface_object->destination_data[i],
-					buffer_object->data + image->offsets[i],
-					image->pitches[i], image->width,
-					i == 0 ? image->height :
-						 image->height / 2);
-		else {
-			memcpy(buffer_object->data + image->offsets[i],
-			       surface_object->destination_data[i],
-			       surface_object->destination_sizes[i]);
-		}
+		memset(&copy, 0, sizeof(copy));
+		copy.src = surface_object->destination_data[i];
+		copy.dst = buffer_object->data + image->offsets[i];
+		copy.pitch = image->pitches[i];
+		copy.width = image->width;
+		copy.height = i == 0 ? image->height : image->height / 2;
+		copy.size = surface_object->destination_sizes[i];
+		copy.tiled = !video_format_is_linear(driver_data->video_format);
+
+		image_copy_plane(&driver_data->image_workers, &copy);
 	}
 
+	surface_sync(surface_object, DMA_BUF_SYNC_END | DMA_BUF_SYNC_READ);
+
 	surface_object->status = VASurfaceReady;
 
 	buffer_object->derived_surface_id = surface_id;
 
-	return VA_STATUS_SUCCESS;
+	status = VA_STATUS_SUCCESS;
+
+complete:
+	surface_map_release(driver_data, surface_object);
+
+	return status;
 }
 
 VAStatus RequestQueryImageFormats(VADriverContextP context,
@@ -26,6 +26,9 @@
 #ifndef _IMAGE_H_
 #define _IMAGE_H_
 
+#include <pthread.h>
+#include <stdbool.h>
+
 #include <va/va_backend.h>
 
 #include "object_heap.h"
@@ -34,11 +37,65 @@
 	((struct object_image *)object_heap_lookup(&(data)->image_heap, id))
 #define IMAGE_ID_OFFSET			0x10000000
 
+#define IMAGE_POOL_SIZE			4
+
 struct object_image {
 	struct object_base base;
 	VAImage image;
 };
 
+/*
+ * Image data given back when image buffers are destroyed, so that the next
+ * images of the same size reuse it instead of allocating frames over again.
+ */
+struct image_pool {
+	pthread_mutex_t mutex;
+	struct {
+		void *data;
+		unsigned int size;
+	} entries[IMAGE_POOL_SIZE];
+	unsigned int entries_count;
+};
+
+/*
+ * Copy of a plane to an image, split in bands: rows of tiles for tiled
+ * sources and page-aligned chunks for linear ones.
+ */
+struct image_copy {
+	void *src;
+	void *dst;
+	unsigned int pitch;
+	unsigned int width;
+	unsigned int height;
+	unsigned int size;
+	bool tiled;
+
+	unsigned int band_rows;
+	unsigned int band_size;
+	unsigned int bands_count;
+	unsigned int bands_next;
+	unsigned int bands_done;
+};
+
+/* Threads sharing image copies with the calling thread. */
+struct image_workers {
+	pthread_t *threads;
+	unsigned int threads_count;
+
+	pthread_mutex_t mutex;
+	pthread_cond_t work_cond;
+	pthread_cond_t done_cond;
+	struct image_copy *copy;
+	bool stop;
+};
+
+void image_workers_start(struct image_workers *workers);
+void image_workers_stop(struct image_workers *workers);
+void image_pool_init(struct image_pool *pool);
+void *image_pool_get(struct image_pool *pool, unsigned int size);
+void image_pool_put(struct image_pool *pool, void *data, unsigned int size);
+void image_pool_destroy(struct image_pool *pool);
+
 VAStatus RequestCreateImage(VADriverContextP context, VAImageFormat *format,
 			    int width, int height, VAImage *image);
 VAStatus RequestDestroyImage(VADriverContextP context, VAImageID image_id);
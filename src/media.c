@@ -25,8 +25,9 @@
 #include <errno.h>
 #include <stdlib.h>
 #include <string.h>
+#include <poll.h>
+#include <unistd.h>
 #include <sys/ioctl.h>
-#include <sys/select.h>
 
 #include <linux/media.h>
 
@@ -78,22 +79,77 @@ int media_request_queue(int request_fd)
 
 int media_request_wait_completion(int request_fd)
 {
-	struct timeval tv = { 0, 300000 };
-	fd_set except_fds;
+	struct pollfd pollfd;
 	int rc;
 
-	FD_ZERO(&except_fds);
-	FD_SET(request_fd, &except_fds);
+	pollfd.fd = request_fd;
+	pollfd.events = POLLPRI;
+	pollfd.revents = 0;
 
-	rc = select(request_fd + 1, NULL, NULL, &except_fds, &tv);
+	rc = poll(&pollfd, 1, 300);
 	if (rc == 0) {
 		request_log("Timeout when waiting for media request\n");
 		return -1;
 	} else if (rc < 0) {
-		request_log("Unable to select media request: %s\n",
+		request_log("Unable to poll media request: %s\n",
 			    strerror(errno));
 		return -1;
 	}
 
 	return 0;
 }
+
+int media_request_pool_reserve(struct media_request_pool *pool, int media_fd,
+			       unsigned int size)
+{
+	int *fds;
+	int fd;
+
+	if (size <= pool->fds_size)
+		return 0;
+
+	fds = realloc(pool->fds, size * sizeof(*fds));
+	if (fds == NULL)
+		return -1;
+
+	pool->fds = fds;
+	pool->fds_size = size;
+
+	while (pool->fds_count < pool->fds_size) {
+		fd = media_request_alloc(media_fd);
+		if (fd < 0)
+			return -1;
+
+		pool->fds[pool->fds_count++] = fd;
+	}
+
+	return 0;
+}
+
+int media_request_pool_get(struct media_request_pool *pool, int media_fd)
+{
+	if (pool->fds_count > 0)
+		return pool->fds[--pool->fds_count];
+
+	/* More requests are in flight than reserved for. */
+	return media_request_alloc(media_fd);
+}
+
+void media_request_pool_put(struct media_request_pool *pool, int request_fd)
+{
+	if (pool->fds_count < pool->fds_size)
+		pool->fds[pool->fds_count++] = request_fd;
+	else
+		close(request_fd);
+}
+
+void media_request_pool_destroy(struct media_request_pool *pool)
+{
+	while (pool->fds_count > 0)
+		close(pool->fds[--pool->fds_count]);
+
+	free(pool->fds);
+
+	pool->fds = NULL;
+	pool->fds_size = 0;
+}
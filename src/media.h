@@ -25,9 +25,20 @@
 #ifndef _MEDIA_H_
 #define _MEDIA_H_
 
+struct media_request_pool {
+	int *fds;
+	unsigned int fds_count;
+	unsigned int fds_size;
+};
+
 int media_request_alloc(int media_fd);
 int media_request_reinit(int request_fd);
 int media_request_queue(int request_fd);
 int media_request_wait_completion(int request_fd);
+int media_request_pool_reserve(struct media_request_pool *pool, int media_fd,
+			       unsigned int size);
+int media_request_pool_get(struct media_request_pool *pool, int media_fd);
+void media_request_pool_put(struct media_request_pool *pool, int request_fd);
+void media_request_pool_destroy(struct media_request_pool *pool);
 
 #endif
@@ -42,17 +42,21 @@ int mpeg2_set_controls(struct request_data *driver_data,
 		       struct object_context *context_object,
 		       struct object_surface *surface_object)
 {
+	struct object_buffer *matrix_buffer = surface_object->matrix_buffer;
+	unsigned int slice_index = surface_object->slice_buffers_count - 1;
 	VAPictureParameterBufferMPEG2 *picture =
-		&surface_object->params.mpeg2.picture;
+		surface_object->picture_buffer->data;
 	VASliceParameterBufferMPEG2 *slice =
-		&surface_object->params.mpeg2.slice;
+		surface_object->slice_buffers[slice_index]->data;
 	VAIQMatrixBufferMPEG2 *iqmatrix =
-		&surface_object->params.mpeg2.iqmatrix;
-	bool iqmatrix_set = surface_object->params.mpeg2.iqmatrix_set;
+		matrix_buffer != NULL ? matrix_buffer->data : NULL;
+	bool iqmatrix_set = matrix_buffer != NULL;
 	struct v4l2_ctrl_mpeg2_slice_params slice_params;
 	struct v4l2_ctrl_mpeg2_quantization quantization;
 	struct object_surface *forward_reference_surface;
 	struct object_surface *backward_reference_surface;
+	struct v4l2_ext_control controls[2] = { 0 };
+	unsigned int controls_count;
 	unsigned int i;
 	int rc;
 
@@ -117,11 +121,10 @@ int mpeg2_set_controls(struct request_data *driver_data,
 		slice_params.backward_ref_index =
 			surface_object->destination_index;
 
-	rc = v4l2_set_control(driver_data->video_fd, surface_object->request_fd,
-			      V4L2_CID_MPEG_VIDEO_MPEG2_SLICE_PARAMS,
-			      &slice_params, sizeof(slice_params));
-	if (rc < 0)
-		return VA_STATUS_ERROR_OPERATION_FAILED;
+	controls[0].id = V4L2_CID_MPEG_VIDEO_MPEG2_SLICE_PARAMS;
+	controls[0].ptr = &slice_params;
+	controls[0].size = sizeof(slice_params);
+	controls_count = 1;
 
 	if (iqmatrix_set) {
 		quantization.load_intra_quantiser_matrix =
@@ -144,11 +147,18 @@ int mpeg2_set_controls(struct request_data *driver_data,
 				iqmatrix->chroma_non_intra_quantiser_matrix[i];
 		}
 
-		rc = v4l2_set_control(driver_data->video_fd,
-				      surface_object->request_fd,
-				      V4L2_CID_MPEG_VIDEO_MPEG2_QUANTIZATION,
-				      &quantization, sizeof(quantization));
+		controls[1].id = V4L2_CID_MPEG_VIDEO_MPEG2_QUANTIZATION;
+		controls[1].ptr = &quantization;
+		controls[1].size = sizeof(quantization);
+		controls_count++;
 	}
 
+	rc = v4l2_set_controls_cached(driver_data->video_fd,
+				      surface_object->request_fd,
+				      &driver_data->control_cache, controls,
+				      controls_count);
+	if (rc < 0)
+		return VA_STATUS_ERROR_OPERATION_FAILED;
+
 	return 0;
 }
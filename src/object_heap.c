@@ -23,168 +23,282 @@
  */
 
 #include <stdlib.h>
+#include <string.h>
 
 #include "object_heap.h"
 
-static int object_heap_expand(struct object_heap *heap)
+static struct object_base *object_heap_slot(struct object_heap *heap,
+					    void **bucket, int index)
+{
+	int bucket_index = index / heap->heap_increment;
+	int object_index = index % heap->heap_increment;
+
+	return (struct object_base *)(bucket[bucket_index] +
+				      object_index * heap->object_size);
+}
+
+static int object_heap_expand(struct object_heap *heap, int slabs_count)
 {
 	struct object_base *object;
 	void *new_heap_index;
-	int new_heap_size = heap->heap_size + heap->heap_increment;
-	int bucket_index = new_heap_size / heap->heap_increment - 1;
+	int new_heap_size = heap->heap_size + slabs_count * heap->heap_increment;
+	int buckets_count = new_heap_size / heap->heap_increment;
+	int bucket_index;
 	int next_free;
 	int i;
 
-	if (bucket_index >= heap->num_buckets) {
-		int new_num_buckets = heap->num_buckets + 8;
+	if (new_heap_size > OBJECT_HEAP_INDEX_MASK + 1)
+		return -1;
+
+	if (buckets_count > heap->num_buckets) {
+		int new_num_buckets = heap->num_buckets > 0 ?
+					      heap->num_buckets * 2 : 8;
+		void ***retired_buckets;
 		void **new_bucket;
 
-		new_bucket = realloc(heap->bucket,
-				     new_num_buckets * sizeof(void *));
+		while (new_num_buckets < buckets_count)
+			new_num_buckets *= 2;
+
+		retired_buckets = realloc(heap->retired_buckets,
+					  (heap->num_retired_buckets + 1) *
+						  sizeof(void **));
+		if (retired_buckets == NULL)
+			return -1;
+
+		heap->retired_buckets = retired_buckets;
+
+		new_bucket = malloc(new_num_buckets * sizeof(void *));
 		if (new_bucket == NULL)
 			return -1;
 
+		if (heap->bucket != NULL) {
+			memcpy(new_bucket, heap->bucket,
+			       heap->num_buckets * sizeof(void *));
+			heap->retired_buckets[heap->num_retired_buckets++] =
+				heap->bucket;
+		}
+
 		heap->num_buckets = new_num_buckets;
-		heap->bucket = new_bucket;
+		__atomic_store_n(&heap->bucket, new_bucket, __ATOMIC_RELEASE);
 	}
 
-	new_heap_index = malloc(heap->heap_increment * heap->object_size);
-	if (new_heap_index == NULL)
-		return -1;
+	for (bucket_index = heap->heap_size / heap->heap_increment;
+	     bucket_index < buckets_count; bucket_index++) {
+		if (posix_memalign(&new_heap_index, OBJECT_HEAP_ALIGNMENT,
+				   heap->heap_increment * heap->object_size))
+			goto error;
+
+		heap->bucket[bucket_index] = new_heap_index;
+	}
 
-	heap->bucket[bucket_index] = new_heap_index;
 	next_free = heap->next_free;
 
 	for (i = new_heap_size; i-- > heap->heap_size;) {
-		object = (struct object_base *)(new_heap_index +
-						(i - heap->heap_size) *
-							heap->object_size);
+		object = object_heap_slot(heap, heap->bucket, i);
 		object->id = i + heap->id_offset;
 		object->next_free = next_free;
+		object->next_live = OBJECT_HEAP_LAST;
+		object->prev_live = OBJECT_HEAP_LAST;
 		next_free = i;
 	}
 
 	heap->next_free = next_free;
-	heap->heap_size = new_heap_size;
+
+	/* Publish the new objects once they are set up. */
+	__atomic_store_n(&heap->heap_size, new_heap_size, __ATOMIC_RELEASE);
 
 	return 0;
+
+error:
+	while (bucket_index-- > heap->heap_size / heap->heap_increment)
+		free(heap->bucket[bucket_index]);
+
+	return -1;
+}
+
+static int object_heap_reserve_unlocked(struct object_heap *heap, int count)
+{
+	int missing = count - (heap->heap_size - heap->live_count);
+	int slabs_count;
+
+	if (missing <= 0)
+		return 0;
+
+	slabs_count = (missing + heap->heap_increment - 1) /
+		      heap->heap_increment;
+
+	return object_heap_expand(heap, slabs_count);
 }
 
 static int object_heap_allocate_unlocked(struct object_heap *heap)
 {
 	struct object_base *object;
-	int bucket_index, object_index;
+	int index;
 
 	if (heap->next_free == OBJECT_HEAP_LAST)
-		if (object_heap_expand(heap) == -1)
+		if (object_heap_expand(heap, 1) == -1)
 			return -1;
 
 	if (heap->next_free < 0)
 		return -1;
 
-	bucket_index = heap->next_free / heap->heap_increment;
-	object_index = heap->next_free % heap->heap_increment;
-
-	object = (struct object_base *)(heap->bucket[bucket_index] +
-					object_index * heap->object_size);
+	index = heap->next_free;
+	object = object_heap_slot(heap, heap->bucket, index);
 	heap->next_free = object->next_free;
-	object->next_free = OBJECT_HEAP_ALLOCATED;
+
+	object->next_live = OBJECT_HEAP_LAST;
+	object->prev_live = heap->live_tail;
+
+	if (heap->live_tail != OBJECT_HEAP_LAST)
+		object_heap_slot(heap, heap->bucket, heap->live_tail)->next_live =
+			index;
+	else
+		heap->live_head = index;
+
+	heap->live_tail = index;
+	heap->live_count++;
+
+	__atomic_store_n(&object->next_free, OBJECT_HEAP_ALLOCATED,
+			 __ATOMIC_RELEASE);
 
 	return object->id;
 }
 
-int object_heap_init(struct object_heap *heap, int object_size, int id_offset)
+int object_heap_init(struct object_heap *heap, int object_size, int id_offset,
+		     int preallocate)
 {
 	pthread_mutex_init(&heap->mutex, NULL);
 
-	heap->object_size = object_size;
+	heap->object_size = (object_size + OBJECT_HEAP_ALIGNMENT - 1) &
+			    ~(OBJECT_HEAP_ALIGNMENT - 1);
 	heap->id_offset = id_offset & OBJECT_HEAP_OFFSET_MASK;
 	heap->heap_size = 0;
-	heap->heap_increment = 16;
+	heap->heap_increment = OBJECT_HEAP_SLAB_SIZE;
 	heap->next_free = OBJECT_HEAP_LAST;
 	heap->num_buckets = 0;
 	heap->bucket = NULL;
+	heap->retired_buckets = NULL;
+	heap->num_retired_buckets = 0;
+	heap->live_head = OBJECT_HEAP_LAST;
+	heap->live_tail = OBJECT_HEAP_LAST;
+	heap->live_count = 0;
+
+	if (preallocate < heap->heap_increment)
+		preallocate = heap->heap_increment;
 
-	return object_heap_expand(heap);
+	return object_heap_reserve_unlocked(heap, preallocate);
 }
 
-int object_heap_allocate(struct object_heap *heap)
+/*
+ * Make sure that count objects can be allocated without growing the heap
+ * again, so that creating many objects at once only grows it once.
+ */
+int object_heap_reserve(struct object_heap *heap, int count)
 {
 	int rc;
 
 	pthread_mutex_lock(&heap->mutex);
-	rc = object_heap_allocate_unlocked(heap);
+	rc = object_heap_reserve_unlocked(heap, count);
 	pthread_mutex_unlock(&heap->mutex);
 
 	return rc;
 }
 
-static struct object_base *object_heap_lookup_unlocked(struct object_heap *heap,
-						       int id)
+int object_heap_allocate(struct object_heap *heap)
 {
-	struct object_base *object;
-	int bucket_index, object_index;
-
-	if ((id < heap->id_offset) ||
-	    (id > (heap->heap_size + heap->id_offset)))
-		return NULL;
-
-	id &= OBJECT_HEAP_ID_MASK;
-	bucket_index = id / heap->heap_increment;
-	object_index = id % heap->heap_increment;
-
-	object = (struct object_base *)(heap->bucket[bucket_index] +
-					object_index * heap->object_size);
+	int rc;
 
-	if (object->next_free != OBJECT_HEAP_ALLOCATED)
-		return NULL;
+	pthread_mutex_lock(&heap->mutex);
+	rc = object_heap_allocate_unlocked(heap);
+	pthread_mutex_unlock(&heap->mutex);
 
-	return object;
+	return rc;
 }
 
+/*
+ * Lookups run concurrently with allocations and frees: objects are only read
+ * once the heap size covering them is published and the bucket array read
+ * at that point holds their slab. Comparing the full ID checks the heap
+ * offset and rejects IDs of objects that were freed since.
+ */
 struct object_base *object_heap_lookup(struct object_heap *heap, int id)
 {
 	struct object_base *object;
+	void **bucket;
+	int heap_size;
+	int index;
 
-	pthread_mutex_lock(&heap->mutex);
-	object = object_heap_lookup_unlocked(heap, id);
-	pthread_mutex_unlock(&heap->mutex);
+	heap_size = __atomic_load_n(&heap->heap_size, __ATOMIC_ACQUIRE);
+
+	index = id & OBJECT_HEAP_INDEX_MASK;
+	if (index >= heap_size)
+		return NULL;
+
+	bucket = __atomic_load_n(&heap->bucket, __ATOMIC_ACQUIRE);
+	object = object_heap_slot(heap, bucket, index);
+
+	/*
+	 * Freeing bumps the generation of the ID before the object can be
+	 * allocated again, so the ID has to be loaded after the allocation
+	 * state: seeing the object allocated again then guarantees seeing the
+	 * new ID and rejecting a stale one.
+	 */
+	if (__atomic_load_n(&object->next_free, __ATOMIC_ACQUIRE) !=
+	    OBJECT_HEAP_ALLOCATED)
+		return NULL;
+
+	if (__atomic_load_n(&object->id, __ATOMIC_ACQUIRE) != id)
+		return NULL;
 
 	return object;
 }
 
 struct object_base *object_heap_first(struct object_heap *heap, int *iterator)
 {
-	*iterator = -1;
+	*iterator = OBJECT_HEAP_LAST;
 
 	return object_heap_next(heap, iterator);
 }
 
+/*
+ * Iteration walks the allocated objects only. Freed objects keep their link
+ * to the object that followed them, so that the object returned last can be
+ * freed before asking for the next one.
+ */
 static struct object_base *object_heap_next_unlocked(struct object_heap *heap,
 						     int *iterator)
 {
 	struct object_base *object;
-	int bucket_index, object_index;
-	int i = *iterator + 1;
-
-	while (i < heap->heap_size) {
-		bucket_index = i / heap->heap_increment;
-		object_index = i % heap->heap_increment;
-
-		object = (struct object_base *)(heap->bucket[bucket_index] +
-						object_index *
-							heap->object_size);
-		if (object->next_free == OBJECT_HEAP_ALLOCATED) {
-			*iterator = i;
-			return object;
+	int index;
+
+	/* Keep returning NULL once the end is reached. */
+	if (*iterator >= heap->heap_size)
+		return NULL;
+
+	if (*iterator == OBJECT_HEAP_LAST) {
+		index = heap->live_head;
+	} else {
+		object = object_heap_slot(heap, heap->bucket, *iterator);
+		index = object->next_live;
+
+		while (object->next_free != OBJECT_HEAP_ALLOCATED &&
+		       index != OBJECT_HEAP_LAST) {
+			object = object_heap_slot(heap, heap->bucket, index);
+			if (object->next_free == OBJECT_HEAP_ALLOCATED)
+				break;
+
+			index = object->next_live;
 		}
+	}
 
-		i++;
+	if (index == OBJECT_HEAP_LAST) {
+		*iterator = heap->heap_size;
+		return NULL;
 	}
 
-	*iterator = i;
+	*iterator = index;
 
-	return NULL;
+	return object_heap_slot(heap, heap->bucket, index);
 }
 
 struct object_base *object_heap_next(struct object_heap *heap, int *iterator)
@@ -201,8 +315,32 @@ struct object_base *object_heap_next(struct object_heap *heap, int *iterator)
 static void object_heap_free_unlocked(struct object_heap *heap,
 				      struct object_base *object)
 {
-	object->next_free = heap->next_free;
-	heap->next_free = object->id & OBJECT_HEAP_ID_MASK;
+	int index = object->id & OBJECT_HEAP_INDEX_MASK;
+	int generation;
+	int id;
+
+	if (object->prev_live != OBJECT_HEAP_LAST)
+		object_heap_slot(heap, heap->bucket, object->prev_live)
+			->next_live = object->next_live;
+	else
+		heap->live_head = object->next_live;
+
+	if (object->next_live != OBJECT_HEAP_LAST)
+		object_heap_slot(heap, heap->bucket, object->next_live)
+			->prev_live = object->prev_live;
+	else
+		heap->live_tail = object->prev_live;
+
+	heap->live_count--;
+
+	generation = (object->id + (1 << OBJECT_HEAP_GENERATION_SHIFT)) &
+		     OBJECT_HEAP_GENERATION_MASK;
+	id = (object->id & ~OBJECT_HEAP_GENERATION_MASK) | generation;
+
+	__atomic_store_n(&object->id, id, __ATOMIC_RELEASE);
+	__atomic_store_n(&object->next_free, heap->next_free,
+			 __ATOMIC_RELEASE);
+	heap->next_free = index;
 }
 
 void object_heap_free(struct object_heap *heap, struct object_base *object)
@@ -224,8 +362,18 @@ void object_heap_destroy(struct object_heap *heap)
 
 	pthread_mutex_destroy(&heap->mutex);
 
+	for (i = 0; i < heap->num_retired_buckets; i++)
+		free(heap->retired_buckets[i]);
+
+	free(heap->retired_buckets);
+	heap->retired_buckets = NULL;
+	heap->num_retired_buckets = 0;
+
 	free(heap->bucket);
 	heap->bucket = NULL;
 	heap->heap_size = 0;
 	heap->next_free = OBJECT_HEAP_LAST;
+	heap->live_head = OBJECT_HEAP_LAST;
+	heap->live_tail = OBJECT_HEAP_LAST;
+	heap->live_count = 0;
 }
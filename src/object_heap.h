@@ -31,12 +31,27 @@
  * Values
  */
 
+/*
+ * IDs are made of the heap offset, a generation bumped each time the object
+ * is freed and the object index, so that stale IDs are rejected by lookups.
+ */
 #define OBJECT_HEAP_OFFSET_MASK					0x7F000000
 #define OBJECT_HEAP_ID_MASK					0x00FFFFFF
+#define OBJECT_HEAP_GENERATION_MASK				0x00FF0000
+#define OBJECT_HEAP_GENERATION_SHIFT				16
+#define OBJECT_HEAP_INDEX_MASK					0x0000FFFF
 
 #define OBJECT_HEAP_LAST					-1
 #define OBJECT_HEAP_ALLOCATED					-2
 
+/*
+ * Objects are stored in slabs of OBJECT_HEAP_SLAB_SIZE slots, each slot
+ * rounded up to a cache line so that objects used by different threads do
+ * not share cache lines.
+ */
+#define OBJECT_HEAP_SLAB_SIZE					16
+#define OBJECT_HEAP_ALIGNMENT					64
+
 /*
  * Structures
  */
@@ -44,8 +59,16 @@
 struct object_base {
 	int id;
 	int next_free;
+	/* Allocated objects are linked together for iteration. */
+	int next_live;
+	int prev_live;
 };
 
+/*
+ * Lookups do not take the mutex: slabs are never moved and bucket arrays
+ * that were replaced are only freed with the heap, since lookups may still
+ * be reading them.
+ */
 struct object_heap {
 	pthread_mutex_t mutex;
 	int object_size;
@@ -55,13 +78,20 @@ struct object_heap {
 	int heap_increment;
 	void **bucket;
 	int num_buckets;
+	void ***retired_buckets;
+	int num_retired_buckets;
+	int live_head;
+	int live_tail;
+	int live_count;
 };
 
 /*
  * Functions
  */
 
-int object_heap_init(struct object_heap *heap, int object_size, int id_offset);
+int object_heap_init(struct object_heap *heap, int object_size, int id_offset,
+		     int preallocate);
+int object_heap_reserve(struct object_heap *heap, int count);
 int object_heap_allocate(struct object_heap *heap);
 struct object_base *object_heap_lookup(struct object_heap *heap, int id);
 struct object_base *object_heap_first(struct object_heap *heap, int *iterator);
@@ -35,11 +35,14 @@
 #include "mpeg2.h"
 
 #include <assert.h>
+#include <pthread.h>
 #include <string.h>
+#include <unistd.h>
 
 #include <errno.h>
 
 #include <sys/ioctl.h>
+#include <sys/time.h>
 
 #include <linux/videodev2.h>
 
@@ -49,127 +52,131 @@
 
 #include "autoconfig.h"
 
+static VAStatus picture_store_slice_data(struct request_data *driver_data,
+					 struct object_context *context_object,
+					 struct object_surface *surface_object,
+					 struct object_buffer *buffer_object)
+{
+	unsigned int size = buffer_object->size * buffer_object->count;
+	unsigned int slices_size = surface_object->slices_size;
+	struct context_source *source;
+	bool in_place;
+	int rc;
+
+	/*
+	 * The picture takes over the source its first slice data was written
+	 * to if that source is still available.
+	 */
+	if (surface_object->source == NULL) {
+		surface_object->source =
+			context_source_claim(driver_data, context_object,
+					     buffer_object->source_offset == 0 ?
+					     buffer_object->source : NULL);
+		if (surface_object->source == NULL)
+			return VA_STATUS_ERROR_ALLOCATION_FAILED;
+	}
+
+	source = surface_object->source;
+	in_place = buffer_object->data == source->data + slices_size;
+
+	/*
+	 * Since there is no guarantee that the allocation order is the same
+	 * as the submission order (via RenderPicture), slice data has to be
+	 * copied when it was not written in place. Copying it over slice data
+	 * that was written to the source but not rendered yet would clobber
+	 * it and a source that slice data buffers point to cannot be grown,
+	 * so move the picture to another source in these cases.
+	 */
+	if ((!in_place && slices_size < source->fill_size) ||
+	    (slices_size + size > source->size && source->users > 0)) {
+		source = context_source_claim(driver_data, context_object,
+					      NULL);
+		if (source == NULL)
+			return VA_STATUS_ERROR_ALLOCATION_FAILED;
+
+		if (slices_size + size > source->size) {
+			rc = context_source_grow(driver_data, context_object,
+						 source, slices_size + size, 0);
+			if (rc < 0) {
+				pthread_mutex_lock(&driver_data->queue_mutex);
+				context_source_release(source);
+				pthread_mutex_unlock(&driver_data->queue_mutex);
+
+				return VA_STATUS_ERROR_ALLOCATION_FAILED;
+			}
+		}
+
+		memcpy(source->data, surface_object->source->data,
+		       slices_size);
+
+		pthread_mutex_lock(&driver_data->queue_mutex);
+		context_source_release(surface_object->source);
+		pthread_mutex_unlock(&driver_data->queue_mutex);
+
+		surface_object->source = source;
+		in_place = false;
+	}
+
+	if (slices_size + size > source->size) {
+		rc = context_source_grow(driver_data, context_object, source,
+					 slices_size + size, slices_size);
+		if (rc < 0)
+			return VA_STATUS_ERROR_ALLOCATION_FAILED;
+	}
+
+	if (!in_place)
+		memmove(source->data + slices_size, buffer_object->data,
+			size);
+
+	surface_object->slices_size += size;
+	surface_object->slices_count++;
+
+	return VA_STATUS_SUCCESS;
+}
+
+static void picture_hold_buffer(struct request_data *driver_data,
+				struct object_buffer **slot,
+				struct object_buffer *buffer_object)
+{
+	buffer_reference(buffer_object);
+
+	if (*slot != NULL)
+		buffer_release(driver_data, *slot);
+
+	*slot = buffer_object;
+}
+
+/*
+ * Parameter buffers are not copied: the surface references them until the
+ * picture ends and the codecs read their data when setting controls.
+ */
 static VAStatus codec_store_buffer(struct request_data *driver_data,
+				   struct object_context *context_object,
 				   VAProfile profile,
 				   struct object_surface *surface_object,
 				   struct object_buffer *buffer_object)
 {
 	switch (buffer_object->type) {
 	case VASliceDataBufferType:
-		/*
-		 * Since there is no guarantee that the allocation
-		 * order is the same as the submission order (via
-		 * RenderPicture), we can't use a V4L2 buffer directly
-		 * and have to copy from a regular buffer.
-		 */
-		memcpy(surface_object->source_data +
-			       surface_object->slices_size,
-		       buffer_object->data,
-		       buffer_object->size * buffer_object->count);
-		surface_object->slices_size +=
-			buffer_object->size * buffer_object->count;
-		surface_object->slices_count++;
-		break;
+		return picture_store_slice_data(driver_data, context_object,
+						surface_object, buffer_object);
 
 	case VAPictureParameterBufferType:
-		switch (profile) {
-#ifdef WITH_MPEG2
-		case VAProfileMPEG2Simple:
-		case VAProfileMPEG2Main:
-			memcpy(&surface_object->params.mpeg2.picture,
-			       buffer_object->data,
-			       sizeof(surface_object->params.mpeg2.picture));
-			break;
-#endif
-
-#ifdef WITH_H264
-		case VAProfileH264Main:
-		case VAProfileH264High:
-		case VAProfileH264ConstrainedBaseline:
-		case VAProfileH264MultiviewHigh:
-		case VAProfileH264StereoHigh:
-			memcpy(&surface_object->params.h264.picture,
-			       buffer_object->data,
-			       sizeof(surface_object->params.h264.picture));
-			break;
-#endif
-
-#ifdef WITH_H265
-		case VAProfileHEVCMain:
-			memcpy(&surface_object->params.h265.picture,
-			       buffer_object->data,
-			       sizeof(surface_object->params.h265.picture));
-			break;
-#endif
-
-		default:
-			break;
-		}
+		picture_hold_buffer(driver_data,
+				    &surface_object->picture_buffer,
+				    buffer_object);
 		break;
 
 	case VASliceParameterBufferType:
-		switch (profile) {
-#ifdef WITH_H264
-		case VAProfileH264Main:
-		case VAProfileH264High:
-		case VAProfileH264ConstrainedBaseline:
-		case VAProfileH264MultiviewHigh:
-		case VAProfileH264StereoHigh:
-			memcpy(&surface_object->params.h264.slice,
-			       buffer_object->data,
-			       sizeof(surface_object->params.h264.slice));
-			break;
-#endif
-
-#ifdef WITH_H265
-		case VAProfileHEVCMain:
-			memcpy(&surface_object->params.h265.slice,
-			       buffer_object->data,
-			       sizeof(surface_object->params.h265.slice));
-			break;
-#endif
-
-		default:
-			break;
-		}
+		if (surface_hold_slice_params(surface_object,
+					      buffer_object) < 0)
+			return VA_STATUS_ERROR_ALLOCATION_FAILED;
 		break;
 
 	case VAIQMatrixBufferType:
-		switch (profile) {
-#ifdef WITH_MPEG2
-		case VAProfileMPEG2Simple:
-		case VAProfileMPEG2Main:
-			memcpy(&surface_object->params.mpeg2.iqmatrix,
-			       buffer_object->data,
-			       sizeof(surface_object->params.mpeg2.iqmatrix));
-			surface_object->params.mpeg2.iqmatrix_set = true;
-			break;
-#endif
-
-#ifdef WITH_H264
-		case VAProfileH264Main:
-		case VAProfileH264High:
-		case VAProfileH264ConstrainedBaseline:
-		case VAProfileH264MultiviewHigh:
-		case VAProfileH264StereoHigh:
-			memcpy(&surface_object->params.h264.matrix,
-			       buffer_object->data,
-			       sizeof(surface_object->params.h264.matrix));
-			break;
-#endif
-
-#ifdef WITH_H265
-		case VAProfileHEVCMain:
-			memcpy(&surface_object->params.h265.iqmatrix,
-			       buffer_object->data,
-			       sizeof(surface_object->params.h265.iqmatrix));
-			surface_object->params.h265.iqmatrix_set = true;
-			break;
-#endif
-
-		default:
-			break;
-		}
+		picture_hold_buffer(driver_data,
+				    &surface_object->matrix_buffer,
+				    buffer_object);
 		break;
 
 	default:
@@ -186,12 +193,16 @@ static VAStatus codec_set_controls(struct request_data *driver_data,
 {
 	int rc;
 
+	if (surface_object->picture_buffer == NULL ||
+	    surface_object->slice_buffers_count == 0)
+		return VA_STATUS_ERROR_OPERATION_FAILED;
+
 	switch (profile) {
 #ifdef WITH_MPEG2
 	case VAProfileMPEG2Simple:
 	case VAProfileMPEG2Main:
 		rc = mpeg2_set_controls(driver_data, context, surface_object);
-		if (rc < 0)
+		if (rc != VA_STATUS_SUCCESS)
 			return VA_STATUS_ERROR_OPERATION_FAILED;
 		break;
 #endif
@@ -203,7 +214,9 @@ static VAStatus codec_set_controls(struct request_data *driver_data,
 	case VAProfileH264MultiviewHigh:
 	case VAProfileH264StereoHigh:
 		rc = h264_set_controls(driver_data, context, surface_object);
-		if (rc < 0)
+		if (rc == VA_STATUS_ERROR_MAX_NUM_EXCEEDED)
+			return rc;
+		else if (rc != VA_STATUS_SUCCESS)
 			return VA_STATUS_ERROR_OPERATION_FAILED;
 		break;
 #endif
@@ -211,7 +224,7 @@ static VAStatus codec_set_controls(struct request_data *driver_data,
 #ifdef WITH_H265
 	case VAProfileHEVCMain:
 		rc = h265_set_controls(driver_data, context, surface_object);
-		if (rc < 0)
+		if (rc != VA_STATUS_SUCCESS)
 			return VA_STATUS_ERROR_OPERATION_FAILED;
 		break;
 #endif
@@ -241,12 +254,205 @@ VAStatus RequestBeginPicture(VADriverContextP context, VAContextID context_id,
 	if (surface_object->status == VASurfaceRendering)
 		RequestSyncSurface(context, surface_id);
 
+	/* Give back the source left behind by a picture that failed. */
+	if (surface_object->source != NULL) {
+		pthread_mutex_lock(&driver_data->queue_mutex);
+		context_source_release(surface_object->source);
+		pthread_mutex_unlock(&driver_data->queue_mutex);
+
+		surface_object->source = NULL;
+	}
+
+	/* Drop the parameters left behind by a picture that failed. */
+	surface_release_params(driver_data, surface_object);
+
 	surface_object->status = VASurfaceRendering;
+	surface_object->slices_size = 0;
+	surface_object->slices_count = 0;
+	surface_object->slice_params_submitted = 0;
 	context_object->render_surface_id = surface_id;
 
 	return VA_STATUS_SUCCESS;
 }
 
+static void picture_request_drop(struct request_data *driver_data,
+				 struct object_surface *surface_object)
+{
+	int request_fd = surface_object->request_fd;
+
+	surface_object->request_fd = -1;
+
+	/* Controls set in the dropped request never reached the device. */
+	v4l2_control_cache_invalidate(&driver_data->control_cache);
+
+	/* Drop whatever was attached to the request before recycling it. */
+	if (media_request_reinit(request_fd) < 0) {
+		close(request_fd);
+		return;
+	}
+
+	pthread_mutex_lock(&driver_data->queue_mutex);
+	media_request_pool_put(&driver_data->request_pool, request_fd);
+	pthread_mutex_unlock(&driver_data->queue_mutex);
+}
+
+static int picture_request_get(struct request_data *driver_data,
+			       struct object_surface *surface_object)
+{
+	int request_fd;
+
+	pthread_mutex_lock(&driver_data->queue_mutex);
+	request_fd = media_request_pool_get(&driver_data->request_pool,
+					    driver_data->media_fd);
+	pthread_mutex_unlock(&driver_data->queue_mutex);
+
+	if (request_fd < 0)
+		return -1;
+
+	surface_object->request_fd = request_fd;
+
+	return 0;
+}
+
+/*
+ * In slice mode, the source buffer is reused for each slice so the request
+ * for the previous slice has to complete before new slice data is copied.
+ */
+static VAStatus picture_slice_wait(struct request_data *driver_data,
+				   struct object_surface *surface_object)
+{
+	struct video_format *video_format = driver_data->video_format;
+	unsigned int output_type;
+	int request_fd = surface_object->request_fd;
+	int rc;
+
+	if (request_fd < 0)
+		return VA_STATUS_SUCCESS;
+
+	output_type = v4l2_type_video_output(video_format->v4l2_mplane);
+
+	rc = media_request_wait_completion(request_fd);
+	if (rc < 0)
+		return VA_STATUS_ERROR_OPERATION_FAILED;
+
+	pthread_mutex_lock(&driver_data->queue_mutex);
+
+	surface_object->request_fd = -1;
+
+	rc = media_request_reinit(request_fd);
+	if (rc < 0)
+		close(request_fd);
+	else
+		media_request_pool_put(&driver_data->request_pool,
+				       request_fd);
+
+	if (rc >= 0)
+		rc = v4l2_dequeue_buffer(driver_data->video_fd, -1, output_type,
+					 surface_object->source->memory,
+					 surface_object->source->index, 1);
+
+	pthread_mutex_unlock(&driver_data->queue_mutex);
+
+	if (rc < 0)
+		return VA_STATUS_ERROR_OPERATION_FAILED;
+
+	return VA_STATUS_SUCCESS;
+}
+
+static VAStatus picture_slice_submit(struct request_data *driver_data,
+				     struct object_context *context_object,
+				     struct object_config *config_object,
+				     struct object_surface *surface_object)
+{
+	struct video_format *video_format = driver_data->video_format;
+	unsigned int output_type, capture_type;
+	VAStatus status;
+	int rc;
+
+	output_type = v4l2_type_video_output(video_format->v4l2_mplane);
+	capture_type = v4l2_type_video_capture(video_format->v4l2_mplane);
+
+	/*
+	 * Slice requests are dequeued from the app thread, which must not
+	 * race with the reactor retiring the pictures queued before.
+	 */
+	if (surface_object->slice_params_submitted == 0) {
+		rc = surface_request_drain(driver_data);
+		if (rc < 0)
+			return VA_STATUS_ERROR_OPERATION_FAILED;
+	}
+
+	rc = picture_request_get(driver_data, surface_object);
+	if (rc < 0)
+		return VA_STATUS_ERROR_OPERATION_FAILED;
+
+	status = codec_set_controls(driver_data, context_object,
+				    config_object->profile, surface_object);
+	if (status != VA_STATUS_SUCCESS)
+		goto error;
+
+	/*
+	 * The capture buffer is queued once with the first slice and held
+	 * by the driver until the decoder is flushed in EndPicture. Every
+	 * slice of the picture carries the same timestamp. The device pairs
+	 * the next queued capture buffer with the next queued request, so
+	 * other pictures must not be queued in between.
+	 */
+	pthread_mutex_lock(&driver_data->queue_mutex);
+
+	if (surface_object->slice_params_submitted == 0) {
+		gettimeofday(&surface_object->timestamp, NULL);
+
+		rc = v4l2_queue_buffer(driver_data->video_fd, -1, capture_type,
+				       surface_object->destination_memory,
+				       NULL, surface_object->destination_index,
+				       surface_object->destination_fds, 0,
+				       surface_object->destination_buffers_count,
+				       0);
+		if (rc < 0)
+			goto error_unlock;
+	}
+
+	rc = v4l2_queue_buffer(driver_data->video_fd,
+			       surface_object->request_fd, output_type,
+			       surface_object->source->memory,
+			       &surface_object->timestamp,
+			       surface_object->source->index,
+			       &surface_object->source->fd,
+			       surface_object->slices_size, 1,
+			       V4L2_BUF_FLAG_M2M_HOLD_CAPTURE_BUF);
+	if (rc < 0)
+		goto error_unlock;
+
+	rc = media_request_queue(surface_object->request_fd);
+	if (rc < 0)
+		goto error_unlock;
+
+	pthread_mutex_unlock(&driver_data->queue_mutex);
+
+	surface_object->slice_params_submitted =
+		surface_object->slice_params_count;
+	surface_object->slices_size = 0;
+
+	return VA_STATUS_SUCCESS;
+
+error_unlock:
+	pthread_mutex_unlock(&driver_data->queue_mutex);
+	status = VA_STATUS_ERROR_OPERATION_FAILED;
+
+error:
+	picture_request_drop(driver_data, surface_object);
+
+	return status;
+}
+
+static bool picture_slice_pending(struct object_surface *surface_object)
+{
+	return surface_object->slices_size > 0 &&
+	       surface_object->slice_params_count >
+	       surface_object->slice_params_submitted;
+}
+
 VAStatus RequestRenderPicture(VADriverContextP context, VAContextID context_id,
 			      VABufferID *buffers_ids, int buffers_count)
 {
@@ -273,37 +479,76 @@ VAStatus RequestRenderPicture(VADriverContextP context, VAContextID context_id,
 
 	for (i = 0; i < buffers_count; i++) {
 		buffer_object = BUFFER(driver_data, buffers_ids[i]);
-		if (buffer_object == NULL)
+		if (buffer_object == NULL ||
+		    __atomic_load_n(&buffer_object->destroyed, __ATOMIC_ACQUIRE))
 			return VA_STATUS_ERROR_INVALID_BUFFER;
 
-		rc = codec_store_buffer(driver_data, config_object->profile,
-					surface_object, buffer_object);
+		if (context_object->slice_mode &&
+		    buffer_object->type == VASliceDataBufferType) {
+			rc = picture_slice_wait(driver_data, surface_object);
+			if (rc != VA_STATUS_SUCCESS)
+				return rc;
+		}
+
+		rc = codec_store_buffer(driver_data, context_object,
+					config_object->profile, surface_object,
+					buffer_object);
 		if (rc != VA_STATUS_SUCCESS)
 			return rc;
 	}
 
+	/* Submit slices as soon as both their parameters and data are in. */
+	if (context_object->slice_mode && picture_slice_pending(surface_object))
+		return picture_slice_submit(driver_data, context_object,
+					    config_object, surface_object);
+
 	return VA_STATUS_SUCCESS;
 }
 
+static VAStatus picture_slice_end(struct request_data *driver_data,
+				  struct object_context *context_object,
+				  struct object_config *config_object,
+				  struct object_surface *surface_object)
+{
+	VAStatus status;
+	int rc;
+
+	if (picture_slice_pending(surface_object)) {
+		status = picture_slice_wait(driver_data, surface_object);
+		if (status != VA_STATUS_SUCCESS)
+			return status;
+
+		status = picture_slice_submit(driver_data, context_object,
+					      config_object, surface_object);
+		if (status != VA_STATUS_SUCCESS)
+			return status;
+	}
+
+	if (surface_object->request_fd < 0)
+		return VA_STATUS_ERROR_OPERATION_FAILED;
+
+	/* Release the capture buffer once the last slice is decoded. */
+	rc = v4l2_decoder_flush(driver_data->video_fd);
+	if (rc < 0)
+		return VA_STATUS_ERROR_OPERATION_FAILED;
+
+	/* The request of the last slice stands for the whole picture. */
+	return surface_request_watch(driver_data, context_object,
+				     surface_object);
+}
+
 VAStatus RequestEndPicture(VADriverContextP context, VAContextID context_id)
 {
 	struct request_data *driver_data = context->pDriverData;
 	struct object_context *context_object;
 	struct object_config *config_object;
 	struct object_surface *surface_object;
-	struct video_format *video_format;
-	unsigned int output_type, capture_type;
-	int request_fd;
 	VAStatus status;
 	int rc;
 
-	video_format = driver_data->video_format;
-	if (video_format == NULL)
+	if (driver_data->video_format == NULL)
 		return VA_STATUS_ERROR_OPERATION_FAILED;
 
-	output_type = v4l2_type_video_output(video_format->v4l2_mplane);
-	capture_type = v4l2_type_video_capture(video_format->v4l2_mplane);
-
 	context_object = CONTEXT(driver_data, context_id);
 	if (context_object == NULL)
 		return VA_STATUS_ERROR_INVALID_CONTEXT;
@@ -317,39 +562,45 @@ VAStatus RequestEndPicture(VADriverContextP context, VAContextID context_id)
 	if (surface_object == NULL)
 		return VA_STATUS_ERROR_INVALID_SURFACE;
 
-	request_fd = surface_object->request_fd;
-	if (request_fd < 0) {
-		request_fd = media_request_alloc(driver_data->media_fd);
-		if (request_fd < 0)
-			return VA_STATUS_ERROR_OPERATION_FAILED;
+	if (surface_object->source == NULL)
+		return VA_STATUS_ERROR_OPERATION_FAILED;
 
-		surface_object->request_fd = request_fd;
-	}
+	if (context_object->slice_mode) {
+		status = picture_slice_end(driver_data, context_object,
+					   config_object, surface_object);
+		surface_release_params(driver_data, surface_object);
+		if (status != VA_STATUS_SUCCESS)
+			return status;
 
-	rc = codec_set_controls(driver_data, context_object,
-				config_object->profile, surface_object);
-	if (rc != VA_STATUS_SUCCESS)
-		return rc;
+		context_object->render_surface_id = VA_INVALID_ID;
 
-	rc = v4l2_queue_buffer(driver_data->video_fd, -1, capture_type,
-			       surface_object->destination_index, 0,
-			       surface_object->destination_buffers_count);
-	if (rc < 0)
-		return VA_STATUS_ERROR_OPERATION_FAILED;
+		return VA_STATUS_SUCCESS;
+	}
 
-	rc = v4l2_queue_buffer(driver_data->video_fd, request_fd, output_type,
-			       surface_object->source_index,
-			       surface_object->slices_size, 1);
+	rc = picture_request_get(driver_data, surface_object);
 	if (rc < 0)
 		return VA_STATUS_ERROR_OPERATION_FAILED;
 
-	surface_object->slices_size = 0;
+	status = codec_set_controls(driver_data, context_object,
+				    config_object->profile, surface_object);
 
-	status = RequestSyncSurface(context, context_object->render_surface_id);
+	/* Controls are copied to the request when set. */
+	surface_release_params(driver_data, surface_object);
+
+	if (status != VA_STATUS_SUCCESS)
+		goto error;
+
+	status = surface_request_queue(driver_data, context_object,
+				       surface_object);
 	if (status != VA_STATUS_SUCCESS)
-		return status;
+		goto error;
 
 	context_object->render_surface_id = VA_INVALID_ID;
 
 	return VA_STATUS_SUCCESS;
+
+error:
+	picture_request_drop(driver_data, surface_object);
+
+	return status;
 }
@@ -36,6 +36,7 @@
 #include <va/va_backend.h>
 
 #include "request.h"
+#include "tiled_yuv.h"
 #include "utils.h"
 #include "v4l2.h"
 
@@ -134,24 +135,37 @@ VAStatus VA_DRIVER_INIT_FUNC(VADriverContextP context)
 
 	context->pDriverData = driver_data;
 
+	tiled_yuv_init();
+
+	pthread_mutex_init(&driver_data->queue_mutex, NULL);
+	pthread_mutex_init(&driver_data->surfaces_mapped_mutex, NULL);
+	driver_data->queued_head_id = VA_INVALID_ID;
+	driver_data->queued_tail_id = VA_INVALID_ID;
+	driver_data->reactor_epoll_fd = -1;
+	driver_data->reactor_event_fd = -1;
+
 	object_heap_init(&driver_data->config_heap,
-			 sizeof(struct object_config), CONFIG_ID_OFFSET);
+			 sizeof(struct object_config), CONFIG_ID_OFFSET, 0);
 	object_heap_init(&driver_data->context_heap,
-			 sizeof(struct object_context), CONTEXT_ID_OFFSET);
+			 sizeof(struct object_context), CONTEXT_ID_OFFSET, 0);
 	object_heap_init(&driver_data->surface_heap,
-			 sizeof(struct object_surface), SURFACE_ID_OFFSET);
+			 sizeof(struct object_surface), SURFACE_ID_OFFSET,
+			 SURFACE_HEAP_PREALLOCATE);
 	object_heap_init(&driver_data->buffer_heap,
-			 sizeof(struct object_buffer), BUFFER_ID_OFFSET);
+			 sizeof(struct object_buffer), BUFFER_ID_OFFSET,
+			 BUFFER_HEAP_PREALLOCATE);
 	object_heap_init(&driver_data->image_heap, sizeof(struct object_image),
-			 IMAGE_ID_OFFSET);
+			 IMAGE_ID_OFFSET, 0);
 
 	video_path = getenv("LIBVA_V4L2_REQUEST_VIDEO_PATH");
 	if (video_path == NULL)
 		video_path = "/dev/video0";
 
 	video_fd = open(video_path, O_RDWR | O_NONBLOCK);
-	if (video_fd < 0)
-		return VA_STATUS_ERROR_OPERATION_FAILED;
+	if (video_fd < 0) {
+		status = VA_STATUS_ERROR_OPERATION_FAILED;
+		goto error;
+	}
 
 	rc = v4l2_query_capabilities(video_fd, &capabilities);
 	if (rc < 0) {
@@ -172,12 +186,26 @@ VAStatus VA_DRIVER_INIT_FUNC(VADriverContextP context)
 		media_path = "/dev/media0";
 
 	media_fd = open(media_path, O_RDWR | O_NONBLOCK);
-	if (media_fd < 0)
-		return VA_STATUS_ERROR_OPERATION_FAILED;
+	if (media_fd < 0) {
+		status = VA_STATUS_ERROR_OPERATION_FAILED;
+		goto error;
+	}
 
 	driver_data->video_fd = video_fd;
 	driver_data->media_fd = media_fd;
 
+	rc = surface_reactor_start(driver_data);
+	if (rc < 0) {
+		status = VA_STATUS_ERROR_OPERATION_FAILED;
+		goto error;
+	}
+
+	/* Nothing can fail past this point, so no thread is left behind. */
+	buffer_pool_init(&driver_data->buffer_pool);
+	image_pool_init(&driver_data->image_pool);
+	v4l2_control_cache_init(&driver_data->control_cache);
+	image_workers_start(&driver_data->image_workers);
+
 	status = VA_STATUS_SUCCESS;
 	goto complete;
 
@@ -204,6 +232,14 @@ VAStatus RequestTerminate(VADriverContextP context)
 	struct object_config *config_object;
 	int iterator;
 
+	/*
+	 * Retire the queued requests and stop the threads before destroying
+	 * the objects they look up.
+	 */
+	surface_request_drain(driver_data);
+	surface_reactor_stop(driver_data);
+	image_workers_stop(&driver_data->image_workers);
+
 	close(driver_data->video_fd);
 	close(driver_data->media_fd);
 
@@ -219,6 +255,18 @@ VAStatus RequestTerminate(VADriverContextP context)
 
 	object_heap_destroy(&driver_data->image_heap);
 
+	/* Surfaces give back the parameter buffers they reference. */
+	surface_object = (struct object_surface *)
+		object_heap_first(&driver_data->surface_heap, &iterator);
+	while (surface_object != NULL) {
+		RequestDestroySurfaces(context,
+				      (VASurfaceID *)&surface_object->base.id, 1);
+		surface_object = (struct object_surface *)
+			object_heap_next(&driver_data->surface_heap, &iterator);
+	}
+
+	object_heap_destroy(&driver_data->surface_heap);
+
 	buffer_object = (struct object_buffer *)
 		object_heap_first(&driver_data->buffer_heap, &iterator);
 	while (buffer_object != NULL) {
@@ -230,16 +278,8 @@ VAStatus RequestTerminate(VADriverContextP context)
 
 	object_heap_destroy(&driver_data->buffer_heap);
 
-	surface_object = (struct object_surface *)
-		object_heap_first(&driver_data->surface_heap, &iterator);
-	while (surface_object != NULL) {
-		RequestDestroySurfaces(context,
-				      (VASurfaceID *)&surface_object->base.id, 1);
-		surface_object = (struct object_surface *)
-			object_heap_next(&driver_data->surface_heap, &iterator);
-	}
-
-	object_heap_destroy(&driver_data->surface_heap);
+	buffer_pool_destroy(&driver_data->buffer_pool);
+	image_pool_destroy(&driver_data->image_pool);
 
 	context_object = (struct object_context *)
 		object_heap_first(&driver_data->context_heap, &iterator);
@@ -263,6 +303,19 @@ VAStatus RequestTerminate(VADriverContextP context)
 
 	object_heap_destroy(&driver_data->config_heap);
 
+	if (getenv("LIBVA_V4L2_REQUEST_STATS") != NULL)
+		request_log("Controls submitted: %lu (%lu bytes), skipped: %lu (%lu bytes)\n",
+			    driver_data->control_cache.submitted_controls,
+			    driver_data->control_cache.submitted_bytes,
+			    driver_data->control_cache.skipped_controls,
+			    driver_data->control_cache.skipped_bytes);
+
+	v4l2_control_cache_destroy(&driver_data->control_cache);
+
+	media_request_pool_destroy(&driver_data->request_pool);
+	pthread_mutex_destroy(&driver_data->surfaces_mapped_mutex);
+	pthread_mutex_destroy(&driver_data->queue_mutex);
+
 	free(context->pDriverData);
 	context->pDriverData = NULL;
 
@@ -26,10 +26,15 @@
 #ifndef _V4L2_REQUEST_H_
 #define _V4L2_REQUEST_H_
 
+#include <pthread.h>
 #include <stdbool.h>
 
+#include "buffer.h"
 #include "context.h"
+#include "image.h"
+#include "media.h"
 #include "object_heap.h"
+#include "v4l2.h"
 #include "video.h"
 #include <va/va.h>
 
@@ -44,6 +49,8 @@
 #define V4L2_REQUEST_MAX_SUBPIC_FORMATS		4
 #define V4L2_REQUEST_MAX_DISPLAY_ATTRIBUTES	4
 
+#define V4L2_REQUEST_PIPELINE_DEPTH		4
+
 struct request_data {
 	struct object_heap config_heap;
 	struct object_heap context_heap;
@@ -54,6 +61,36 @@ struct request_data {
 	int media_fd;
 
 	struct video_format *video_format;
+
+	/* Recycled buffer and image buffer data. */
+	struct buffer_pool buffer_pool;
+	struct image_pool image_pool;
+	struct image_workers image_workers;
+
+	/*
+	 * Surfaces with buffers mapped for CPU access. The mutex also guards
+	 * the mapping of each surface, the derived images pinning it and the
+	 * buffers exported for it.
+	 */
+	pthread_mutex_t surfaces_mapped_mutex;
+	unsigned int surfaces_mapped_count;
+	unsigned long surfaces_mapped_sequence;
+
+	/* Controls are device state, shared by all contexts. */
+	struct v4l2_control_cache control_cache;
+
+	/* Surfaces with a queued media request, in submission order. */
+	pthread_mutex_t queue_mutex;
+	VASurfaceID queued_head_id;
+	VASurfaceID queued_tail_id;
+
+	/* Recycled media request fds, also protected by queue_mutex. */
+	struct media_request_pool request_pool;
+
+	/* Completion thread watching queued media requests. */
+	pthread_t reactor_thread;
+	int reactor_epoll_fd;
+	int reactor_event_fd;
 };
 
 VAStatus VA_DRIVER_INIT_FUNC(VADriverContextP context);
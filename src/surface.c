@@ -28,16 +28,23 @@
 
 #include <assert.h>
 #include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 #include <fcntl.h>
 
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
 #include <sys/ioctl.h>
 #include <sys/mman.h>
 
 #include <va/va_drmcommon.h>
 #include <drm_fourcc.h>
+#include <linux/dma-buf.h>
 #include <linux/videodev2.h>
 
 #include "media.h"
@@ -45,6 +52,103 @@
 #include "v4l2.h"
 #include "video.h"
 
+#define SURFACE_REACTOR_EVENTS		16
+#define SURFACE_REQUEST_TIMEOUT		1 /* Seconds */
+#define SURFACE_MAPPED_MAX		4
+
+/*
+ * Take a reference to the caller's DMABUF objects backing a surface. The
+ * layout is imposed by the capture format, so the buffers must match it.
+ */
+static int surface_import_buffers(struct object_surface *surface_object,
+				  struct video_format *video_format,
+				  unsigned int memory_type, void *descriptor,
+				  unsigned int index)
+{
+	VASurfaceAttribExternalBuffers *external_buffers;
+	VADRMPRIMESurfaceDescriptor *surface_descriptor;
+	unsigned int buffers_count = surface_object->destination_buffers_count;
+	unsigned int planes_count = surface_object->destination_planes_count;
+	unsigned int sizes[VIDEO_MAX_PLANES];
+	unsigned int offsets[VIDEO_MAX_PLANES];
+	unsigned int pitches[VIDEO_MAX_PLANES];
+	unsigned int objects[VIDEO_MAX_PLANES];
+	int fds[VIDEO_MAX_PLANES];
+	unsigned int i;
+
+	if (memory_type == VA_SURFACE_ATTRIB_MEM_TYPE_DRM_PRIME) {
+		external_buffers = descriptor;
+
+		if (!video_format_is_linear(video_format) ||
+		    external_buffers->pixel_format != VA_FOURCC_NV12 ||
+		    external_buffers->num_planes != planes_count ||
+		    index >= external_buffers->num_buffers ||
+		    buffers_count != 1)
+			return -1;
+
+		fds[0] = external_buffers->buffers[index];
+		sizes[0] = external_buffers->data_size;
+
+		for (i = 0; i < planes_count; i++) {
+			offsets[i] = external_buffers->offsets[i];
+			pitches[i] = external_buffers->pitches[i];
+			objects[i] = 0;
+		}
+	} else {
+		surface_descriptor = descriptor;
+
+		if (surface_descriptor->num_objects != buffers_count ||
+		    surface_descriptor->num_layers != 1 ||
+		    surface_descriptor->layers[0].drm_format !=
+		    video_format->drm_format ||
+		    surface_descriptor->layers[0].num_planes != planes_count)
+			return -1;
+
+		for (i = 0; i < buffers_count; i++) {
+			if (surface_descriptor->objects[i].drm_format_modifier !=
+			    video_format->drm_modifier)
+				return -1;
+
+			fds[i] = surface_descriptor->objects[i].fd;
+			sizes[i] = surface_descriptor->objects[i].size;
+		}
+
+		for (i = 0; i < planes_count; i++) {
+			offsets[i] = surface_descriptor->layers[0].offset[i];
+			pitches[i] = surface_descriptor->layers[0].pitch[i];
+			objects[i] = surface_descriptor->layers[0].object_index[i];
+		}
+	}
+
+	for (i = 0; i < planes_count; i++) {
+		if (objects[i] != (buffers_count == 1 ? 0 : i) ||
+		    offsets[i] != surface_object->destination_offsets[i] ||
+		    pitches[i] != surface_object->destination_bytesperlines[i] ||
+		    offsets[i] + surface_object->destination_sizes[i] >
+		    sizes[objects[i]])
+			return -1;
+	}
+
+	for (i = 0; i < buffers_count; i++) {
+		surface_object->destination_fds[i] = dup(fds[i]);
+		if (surface_object->destination_fds[i] < 0)
+			goto error;
+
+		surface_object->destination_map_lengths[i] = sizes[i];
+		surface_object->destination_map_offsets[i] = 0;
+	}
+
+	return 0;
+
+error:
+	while (i-- > 0) {
+		close(surface_object->destination_fds[i]);
+		surface_object->destination_fds[i] = -1;
+	}
+
+	return -1;
+}
+
 VAStatus RequestCreateSurfaces2(VADriverContextP context, unsigned int format,
 				unsigned int width, unsigned int height,
 				VASurfaceID *surfaces_ids,
@@ -59,7 +163,10 @@ VAStatus RequestCreateSurfaces2(VADriverContextP context, unsigned int format,
 	unsigned int destination_bytesperlines[VIDEO_MAX_PLANES];
 	unsigned int destination_planes_count;
 	unsigned int format_width, format_height;
+	unsigned int memory_type = VA_SURFACE_ATTRIB_MEM_TYPE_VA;
+	void *descriptor = NULL;
 	unsigned int capture_type;
+	unsigned int memory;
 	unsigned int index_base;
 	unsigned int index;
 	unsigned int i, j;
@@ -70,6 +177,43 @@ VAStatus RequestCreateSurfaces2(VADriverContextP context, unsigned int format,
 	if (format != VA_RT_FORMAT_YUV420)
 		return VA_STATUS_ERROR_UNSUPPORTED_RT_FORMAT;
 
+	for (i = 0; i < attributes_count; i++) {
+		if (!(attributes[i].flags & VA_SURFACE_ATTRIB_SETTABLE))
+			continue;
+
+		switch (attributes[i].type) {
+		case VASurfaceAttribMemoryType:
+			memory_type = attributes[i].value.value.i;
+			break;
+		case VASurfaceAttribExternalBufferDescriptor:
+			descriptor = attributes[i].value.value.p;
+			break;
+		default:
+			break;
+		}
+	}
+
+	switch (memory_type) {
+	case VA_SURFACE_ATTRIB_MEM_TYPE_VA:
+		memory = V4L2_MEMORY_MMAP;
+		break;
+	case VA_SURFACE_ATTRIB_MEM_TYPE_DRM_PRIME:
+		memory = V4L2_MEMORY_DMABUF;
+		break;
+	case VA_SURFACE_ATTRIB_MEM_TYPE_DRM_PRIME_2:
+		/* A single descriptor describes a single surface. */
+		if (surfaces_count != 1)
+			return VA_STATUS_ERROR_INVALID_PARAMETER;
+
+		memory = V4L2_MEMORY_DMABUF;
+		break;
+	default:
+		return VA_STATUS_ERROR_UNSUPPORTED_MEMORY_TYPE;
+	}
+
+	if (memory == V4L2_MEMORY_DMABUF && descriptor == NULL)
+		return VA_STATUS_ERROR_INVALID_PARAMETER;
+
 	found = v4l2_find_format(driver_data->video_fd,
 				 V4L2_BUF_TYPE_VIDEO_CAPTURE,
 				 V4L2_PIX_FMT_SUNXI_TILED_NV12);
@@ -90,7 +234,7 @@ VAStatus RequestCreateSurfaces2(VADriverContextP context, unsigned int format,
 	capture_type = v4l2_type_video_capture(video_format->v4l2_mplane);
 
 	rc = v4l2_set_format(driver_data->video_fd, capture_type,
-			     video_format->v4l2_format, width, height);
+			     video_format->v4l2_format, width, height, 0);
 	if (rc < 0)
 		return VA_STATUS_ERROR_OPERATION_FAILED;
 
@@ -102,8 +246,12 @@ VAStatus RequestCreateSurfaces2(VADriverContextP context, unsigned int format,
 
 	destination_planes_count = video_format->planes_count;
 
-	rc = v4l2_create_buffers(driver_data->video_fd, capture_type,
-				 surfaces_count, &index_base);
+	rc = v4l2_create_buffers(driver_data->video_fd, capture_type, memory,
+				 surfaces_count, 0, &index_base, NULL);
+	if (rc < 0)
+		return VA_STATUS_ERROR_ALLOCATION_FAILED;
+
+	rc = object_heap_reserve(&driver_data->surface_heap, surfaces_count);
 	if (rc < 0)
 		return VA_STATUS_ERROR_ALLOCATION_FAILED;
 
@@ -115,25 +263,10 @@ VAStatus RequestCreateSurfaces2(VADriverContextP context, unsigned int format,
 		if (surface_object == NULL)
 			return VA_STATUS_ERROR_ALLOCATION_FAILED;
 
-		rc = v4l2_query_buffer(driver_data->video_fd, capture_type,
-				       index,
-				       surface_object->destination_map_lengths,
-				       surface_object->destination_map_offsets,
-				       video_format->v4l2_buffers_count);
-		if (rc < 0)
-			return VA_STATUS_ERROR_ALLOCATION_FAILED;
-
-		for (j = 0; j < video_format->v4l2_buffers_count; j++) {
-			surface_object->destination_map[j] =
-				mmap(NULL,
-				     surface_object->destination_map_lengths[j],
-				     PROT_READ | PROT_WRITE, MAP_SHARED,
-				     driver_data->video_fd,
-				     surface_object->destination_map_offsets[j]);
-
-			if (surface_object->destination_map[j] == MAP_FAILED)
-				return VA_STATUS_ERROR_ALLOCATION_FAILED;
-		}
+		surface_object->destination_planes_count =
+			destination_planes_count;
+		surface_object->destination_buffers_count =
+			video_format->v4l2_buffers_count;
 
 		/*
 		 * FIXME: Handle this per-pixelformat, trying to generalize it
@@ -151,9 +284,6 @@ VAStatus RequestCreateSurfaces2(VADriverContextP context, unsigned int format,
 			for (j = 0; j < destination_planes_count; j++) {
 				surface_object->destination_offsets[j] =
 					j > 0 ? destination_sizes[j - 1] : 0;
-				surface_object->destination_data[j] =
-					((unsigned char *)surface_object->destination_map[0] +
-					 surface_object->destination_offsets[j]);
 				surface_object->destination_sizes[j] =
 					destination_sizes[j];
 				surface_object->destination_bytesperlines[j] =
@@ -162,8 +292,6 @@ VAStatus RequestCreateSurfaces2(VADriverContextP context, unsigned int format,
 		} else if (video_format->v4l2_buffers_count == destination_planes_count) {
 			for (j = 0; j < destination_planes_count; j++) {
 				surface_object->destination_offsets[j] = 0;
-				surface_object->destination_data[j] =
-					surface_object->destination_map[j];
 				surface_object->destination_sizes[j] =
 					destination_sizes[j];
 				surface_object->destination_bytesperlines[j] =
@@ -173,27 +301,62 @@ VAStatus RequestCreateSurfaces2(VADriverContextP context, unsigned int format,
 			return VA_STATUS_ERROR_ALLOCATION_FAILED;
 		}
 
+		for (j = 0; j < VIDEO_MAX_PLANES; j++)
+			surface_object->destination_fds[j] = -1;
+
+		if (memory == V4L2_MEMORY_DMABUF) {
+			rc = surface_import_buffers(surface_object,
+						    video_format, memory_type,
+						    descriptor, i);
+			if (rc < 0) {
+				request_log("Unable to import surface buffers\n");
+				return VA_STATUS_ERROR_INVALID_PARAMETER;
+			}
+		} else {
+			rc = v4l2_query_buffer(driver_data->video_fd,
+					       capture_type, index,
+					       surface_object->destination_map_lengths,
+					       surface_object->destination_map_offsets,
+					       video_format->v4l2_buffers_count);
+			if (rc < 0)
+				return VA_STATUS_ERROR_ALLOCATION_FAILED;
+		}
+
+		/* Buffers are only mapped when accessed by the CPU. */
+		for (j = 0; j < VIDEO_MAX_PLANES; j++) {
+			surface_object->destination_map[j] = NULL;
+			surface_object->destination_data[j] = NULL;
+		}
+
+		surface_object->destination_map_sequence = 0;
+		surface_object->destination_map_users = 0;
+
 		surface_object->status = VASurfaceReady;
 		surface_object->width = width;
 		surface_object->height = height;
 
-		surface_object->source_index = 0;
-		surface_object->source_data = NULL;
-		surface_object->source_size = 0;
+		surface_object->source = NULL;
 
 		surface_object->destination_index = index;
+		surface_object->destination_memory = memory;
 
-		surface_object->destination_planes_count =
-			destination_planes_count;
-		surface_object->destination_buffers_count =
-			video_format->v4l2_buffers_count;
-
-		memset(&surface_object->params, 0,
-		       sizeof(surface_object->params));
 		surface_object->slices_count = 0;
 		surface_object->slices_size = 0;
 
+		surface_object->picture_buffer = NULL;
+		surface_object->matrix_buffer = NULL;
+		surface_object->slice_buffers = NULL;
+		surface_object->slice_buffers_count = 0;
+		surface_object->slice_buffers_size = 0;
+		surface_object->slice_params_count = 0;
+		surface_object->slice_params_submitted = 0;
+
 		surface_object->request_fd = -1;
+		surface_object->request_queued = false;
+		surface_object->request_completed = false;
+		surface_object->queued_next_id = VA_INVALID_ID;
+		surface_object->queued_context_id = VA_INVALID_ID;
+		pthread_cond_init(&surface_object->request_cond, NULL);
 
 		surfaces_ids[i] = id;
 	}
@@ -209,32 +372,109 @@ VAStatus RequestCreateSurfaces(VADriverContextP context, int width, int height,
 				      surfaces_ids, surfaces_count, NULL, 0);
 }
 
+static int surface_request_wait(struct request_data *driver_data,
+				struct object_surface *surface_object)
+{
+	struct timespec timeout;
+	int rc;
+
+	clock_gettime(CLOCK_REALTIME, &timeout);
+	timeout.tv_sec += SURFACE_REQUEST_TIMEOUT;
+
+	while (surface_object->request_queued) {
+		rc = pthread_cond_timedwait(&surface_object->request_cond,
+					    &driver_data->queue_mutex,
+					    &timeout);
+		if (rc == ETIMEDOUT) {
+			request_log("Timeout when waiting for media request\n");
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+/* Called with the surfaces mapped mutex held. */
+static void surface_unmap(struct request_data *driver_data,
+			  struct object_surface *surface_object)
+{
+	unsigned int i;
+
+	if (surface_object->destination_map[0] == NULL)
+		return;
+
+	for (i = 0; i < surface_object->destination_buffers_count; i++) {
+		munmap(surface_object->destination_map[i],
+		       surface_object->destination_map_lengths[i]);
+		surface_object->destination_map[i] = NULL;
+	}
+
+	for (i = 0; i < surface_object->destination_planes_count; i++)
+		surface_object->destination_data[i] = NULL;
+
+	driver_data->surfaces_mapped_count--;
+}
+
 VAStatus RequestDestroySurfaces(VADriverContextP context,
 				VASurfaceID *surfaces_ids, int surfaces_count)
 {
 	struct request_data *driver_data = context->pDriverData;
 	struct object_surface *surface_object;
 	unsigned int i, j;
+	int rc;
 
 	for (i = 0; i < surfaces_count; i++) {
 		surface_object = SURFACE(driver_data, surfaces_ids[i]);
 		if (surface_object == NULL)
 			return VA_STATUS_ERROR_INVALID_SURFACE;
 
-		if (surface_object->source_data != NULL &&
-		    surface_object->source_size > 0)
-			munmap(surface_object->source_data,
-			       surface_object->source_size);
+		/*
+		 * A surface that is still queued is linked in the queue of
+		 * requests and its buffers still belong to the device.
+		 */
+		pthread_mutex_lock(&driver_data->queue_mutex);
+
+		rc = surface_request_wait(driver_data, surface_object);
+		if (rc < 0) {
+			pthread_mutex_unlock(&driver_data->queue_mutex);
+			return VA_STATUS_ERROR_SURFACE_BUSY;
+		}
+
+		/* Give back the source left behind by a picture that failed. */
+		if (surface_object->source != NULL) {
+			context_source_release(surface_object->source);
+			surface_object->source = NULL;
+		}
+
+		pthread_mutex_unlock(&driver_data->queue_mutex);
+
+		/* Derived images point to the surface mapping. */
+		pthread_mutex_lock(&driver_data->surfaces_mapped_mutex);
+
+		if (surface_object->destination_map_users > 0) {
+			pthread_mutex_unlock(&driver_data->surfaces_mapped_mutex);
+			return VA_STATUS_ERROR_SURFACE_IN_USE;
+		}
+
+		surface_unmap(driver_data, surface_object);
+
+		pthread_mutex_unlock(&driver_data->surfaces_mapped_mutex);
 
 		for (j = 0; j < surface_object->destination_buffers_count; j++)
-			if (surface_object->destination_map[j] != NULL &&
-			    surface_object->destination_map_lengths[j] > 0)
-				munmap(surface_object->destination_map[j],
-				       surface_object->destination_map_lengths[j]);
+			if (surface_object->destination_fds[j] >= 0)
+				close(surface_object->destination_fds[j]);
 
-		if (surface_object->request_fd > 0)
+		surface_release_params(driver_data, surface_object);
+
+		if (surface_object->slice_buffers != NULL)
+			free(surface_object->slice_buffers);
+
+		/* A slice request was left behind by an unfinished picture. */
+		if (surface_object->request_fd >= 0)
 			close(surface_object->request_fd);
 
+		pthread_cond_destroy(&surface_object->request_cond);
+
 		object_heap_free(&driver_data->surface_heap,
 				 (struct object_base *)surface_object);
 	}
@@ -242,87 +482,608 @@ VAStatus RequestDestroySurfaces(VADriverContextP context,
 	return VA_STATUS_SUCCESS;
 }
 
-VAStatus RequestSyncSurface(VADriverContextP context, VASurfaceID surface_id)
+/*
+ * Map the buffers of a surface for CPU access and pin the mapping until
+ * surface_map_release. Only a few surfaces are kept mapped at a time to
+ * spare address space: the least recently mapped one that is not pinned is
+ * unmapped to make room.
+ */
+int surface_map(struct request_data *driver_data,
+		struct object_surface *surface_object)
 {
-	struct request_data *driver_data = context->pDriverData;
-	struct object_surface *surface_object;
-	VAStatus status;
-	struct video_format *video_format;
-	unsigned int output_type, capture_type;
-	int request_fd = -1;
+	struct object_surface *oldest_object = NULL;
+	struct object_surface *iterator_object;
+	unsigned char *destination_map;
+	unsigned int buffers_count = surface_object->destination_buffers_count;
+	int iterator;
+	int fd;
+	unsigned int i;
+
+	pthread_mutex_lock(&driver_data->surfaces_mapped_mutex);
+
+	surface_object->destination_map_sequence =
+		++driver_data->surfaces_mapped_sequence;
+
+	if (surface_object->destination_map[0] != NULL)
+		goto complete;
+
+	if (driver_data->surfaces_mapped_count >= SURFACE_MAPPED_MAX) {
+		iterator_object = (struct object_surface *)
+			object_heap_first(&driver_data->surface_heap,
+					  &iterator);
+		while (iterator_object != NULL) {
+			if (iterator_object->destination_map[0] != NULL &&
+			    iterator_object->destination_map_users == 0 &&
+			    (oldest_object == NULL ||
+			     iterator_object->destination_map_sequence <
+			     oldest_object->destination_map_sequence))
+				oldest_object = iterator_object;
+
+			iterator_object = (struct object_surface *)
+				object_heap_next(&driver_data->surface_heap,
+						 &iterator);
+		}
+
+		if (oldest_object != NULL)
+			surface_unmap(driver_data, oldest_object);
+	}
+
+	for (i = 0; i < buffers_count; i++) {
+		if (surface_object->destination_memory == V4L2_MEMORY_DMABUF)
+			fd = surface_object->destination_fds[i];
+		else
+			fd = driver_data->video_fd;
+
+		surface_object->destination_map[i] =
+			mmap(NULL, surface_object->destination_map_lengths[i],
+			     PROT_READ | PROT_WRITE, MAP_SHARED, fd,
+			     surface_object->destination_map_offsets[i]);
+		if (surface_object->destination_map[i] == MAP_FAILED) {
+			request_log("Unable to map surface buffer: %s\n",
+				    strerror(errno));
+			goto error;
+		}
+	}
+
+	for (i = 0; i < surface_object->destination_planes_count; i++) {
+		destination_map =
+			surface_object->destination_map[buffers_count == 1 ?
+							0 : i];
+		surface_object->destination_data[i] =
+			destination_map + surface_object->destination_offsets[i];
+	}
+
+	driver_data->surfaces_mapped_count++;
+
+complete:
+	surface_object->destination_map_users++;
+
+	pthread_mutex_unlock(&driver_data->surfaces_mapped_mutex);
+
+	return 0;
+
+error:
+	surface_object->destination_map[i] = NULL;
+
+	while (i-- > 0) {
+		munmap(surface_object->destination_map[i],
+		       surface_object->destination_map_lengths[i]);
+		surface_object->destination_map[i] = NULL;
+	}
+
+	pthread_mutex_unlock(&driver_data->surfaces_mapped_mutex);
+
+	return -1;
+}
+
+void surface_map_release(struct request_data *driver_data,
+			 struct object_surface *surface_object)
+{
+	pthread_mutex_lock(&driver_data->surfaces_mapped_mutex);
+	surface_object->destination_map_users--;
+	pthread_mutex_unlock(&driver_data->surfaces_mapped_mutex);
+}
+
+/*
+ * Bracket CPU access to imported buffers, that are mapped through DMABUF, so
+ * that caches are maintained. Buffers allocated by V4L2 are synchronized by
+ * the driver when dequeued.
+ */
+void surface_sync(struct object_surface *surface_object, unsigned int flags)
+{
+	struct dma_buf_sync sync;
+	unsigned int i;
 	int rc;
 
-	video_format = driver_data->video_format;
-	if (video_format == NULL) {
-		status = VA_STATUS_ERROR_OPERATION_FAILED;
-		goto error;
+	if (surface_object->destination_memory != V4L2_MEMORY_DMABUF)
+		return;
+
+	memset(&sync, 0, sizeof(sync));
+	sync.flags = flags;
+
+	for (i = 0; i < surface_object->destination_buffers_count; i++) {
+		rc = ioctl(surface_object->destination_fds[i],
+			   DMA_BUF_IOCTL_SYNC, &sync);
+		if (rc < 0)
+			request_log("Unable to sync surface buffer: %s\n",
+				    strerror(errno));
+	}
+}
+
+int surface_hold_slice_params(struct object_surface *surface_object,
+			      struct object_buffer *buffer_object)
+{
+	unsigned int count = surface_object->slice_buffers_count;
+	struct object_buffer **buffers;
+	unsigned int size;
+
+	if (count == surface_object->slice_buffers_size) {
+		size = count > 0 ? 2 * count : 8;
+
+		buffers = realloc(surface_object->slice_buffers,
+				  size * sizeof(*buffers));
+		if (buffers == NULL)
+			return -1;
+
+		surface_object->slice_buffers = buffers;
+		surface_object->slice_buffers_size = size;
 	}
 
+	buffer_reference(buffer_object);
+
+	surface_object->slice_buffers[count] = buffer_object;
+	surface_object->slice_buffers_count++;
+	surface_object->slice_params_count += buffer_object->count;
+
+	return 0;
+}
+
+void surface_release_params(struct request_data *driver_data,
+			    struct object_surface *surface_object)
+{
+	unsigned int i;
+
+	if (surface_object->picture_buffer != NULL)
+		buffer_release(driver_data, surface_object->picture_buffer);
+
+	if (surface_object->matrix_buffer != NULL)
+		buffer_release(driver_data, surface_object->matrix_buffer);
+
+	for (i = 0; i < surface_object->slice_buffers_count; i++)
+		buffer_release(driver_data, surface_object->slice_buffers[i]);
+
+	surface_object->picture_buffer = NULL;
+	surface_object->matrix_buffer = NULL;
+	surface_object->slice_buffers_count = 0;
+	surface_object->slice_params_count = 0;
+}
+
+/*
+ * Wait for the oldest queued request to be retired. Called with the queue
+ * mutex held.
+ */
+int surface_request_wait_oldest(struct request_data *driver_data)
+{
+	struct object_surface *head_object;
+
+	head_object = SURFACE(driver_data, driver_data->queued_head_id);
+	if (head_object == NULL)
+		return -1;
+
+	return surface_request_wait(driver_data, head_object);
+}
+
+/*
+ * Wait for all the queued requests to be retired, so that the app thread can
+ * dequeue buffers itself without taking those of other pictures.
+ */
+int surface_request_drain(struct request_data *driver_data)
+{
+	int rc = 0;
+
+	pthread_mutex_lock(&driver_data->queue_mutex);
+
+	while (driver_data->queued_head_id != VA_INVALID_ID) {
+		rc = surface_request_wait_oldest(driver_data);
+		if (rc < 0)
+			break;
+	}
+
+	pthread_mutex_unlock(&driver_data->queue_mutex);
+
+	return rc;
+}
+
+static int surface_request_complete(struct request_data *driver_data,
+				    struct object_surface *surface_object)
+{
+	struct video_format *video_format = driver_data->video_format;
+	struct object_context *context_object;
+	unsigned int output_type, capture_type;
+	int request_fd = surface_object->request_fd;
+	int rc;
+
 	output_type = v4l2_type_video_output(video_format->v4l2_mplane);
 	capture_type = v4l2_type_video_capture(video_format->v4l2_mplane);
 
-	surface_object = SURFACE(driver_data, surface_id);
-	if (surface_object == NULL) {
-		status = VA_STATUS_ERROR_INVALID_SURFACE;
-		goto error;
+	driver_data->queued_head_id = surface_object->queued_next_id;
+	if (driver_data->queued_head_id == VA_INVALID_ID)
+		driver_data->queued_tail_id = VA_INVALID_ID;
+
+	context_object = CONTEXT(driver_data,
+				 surface_object->queued_context_id);
+	if (context_object != NULL)
+		context_object->queued_count--;
+
+	surface_object->queued_next_id = VA_INVALID_ID;
+	surface_object->queued_context_id = VA_INVALID_ID;
+	surface_object->request_queued = false;
+	surface_object->request_completed = false;
+
+	/*
+	 * Only completed requests are retired, so the request can be dropped
+	 * when it cannot be recycled. Its buffers still have to be dequeued
+	 * to keep the queues in order, and its source is given back anyway.
+	 */
+	surface_object->request_fd = -1;
+
+	rc = media_request_reinit(request_fd);
+	if (rc < 0)
+		close(request_fd);
+	else
+		media_request_pool_put(&driver_data->request_pool,
+				       request_fd);
+
+	rc = v4l2_dequeue_buffer(driver_data->video_fd, -1, output_type,
+				 surface_object->source->memory,
+				 surface_object->source->index, 1);
+
+	context_source_release(surface_object->source);
+	surface_object->source = NULL;
+
+	if (rc < 0)
+		return -1;
+
+	rc = v4l2_dequeue_buffer(driver_data->video_fd, -1, capture_type,
+				 surface_object->destination_memory,
+				 surface_object->destination_index,
+				 surface_object->destination_buffers_count);
+	if (rc < 0)
+		return -1;
+
+	surface_object->status = VASurfaceDisplaying;
+
+	return 0;
+}
+
+/*
+ * Buffers can only be dequeued in submission order, so only retire completed
+ * requests from the head of the queue. Called with the queue mutex held.
+ */
+static void surface_request_retire(struct request_data *driver_data)
+{
+	struct object_surface *surface_object;
+
+	while (true) {
+		surface_object = SURFACE(driver_data,
+					 driver_data->queued_head_id);
+		if (surface_object == NULL ||
+		    !surface_object->request_completed)
+			break;
+
+		surface_request_complete(driver_data, surface_object);
+		pthread_cond_broadcast(&surface_object->request_cond);
 	}
+}
 
-	if (surface_object->status != VASurfaceRendering) {
-		status = VA_STATUS_SUCCESS;
-		goto complete;
+/*
+ * The device pairs the next queued capture buffer with the next queued
+ * request, so both buffers and the request are queued together. Called with
+ * the queue mutex held.
+ */
+static int surface_request_submit(struct request_data *driver_data,
+				  struct object_surface *surface_object)
+{
+	struct video_format *video_format = driver_data->video_format;
+	unsigned int output_type, capture_type;
+	int rc;
+
+	output_type = v4l2_type_video_output(video_format->v4l2_mplane);
+	capture_type = v4l2_type_video_capture(video_format->v4l2_mplane);
+
+	rc = v4l2_queue_buffer(driver_data->video_fd, -1, capture_type,
+			       surface_object->destination_memory, NULL,
+			       surface_object->destination_index,
+			       surface_object->destination_fds, 0,
+			       surface_object->destination_buffers_count, 0);
+	if (rc < 0)
+		return -1;
+
+	rc = v4l2_queue_buffer(driver_data->video_fd,
+			       surface_object->request_fd, output_type,
+			       surface_object->source->memory, NULL,
+			       surface_object->source->index,
+			       &surface_object->source->fd,
+			       surface_object->slices_size, 1, 0);
+	if (rc < 0)
+		return -1;
+
+	return media_request_queue(surface_object->request_fd);
+}
+
+static VAStatus surface_request_track(struct request_data *driver_data,
+				      struct object_context *context_object,
+				      struct object_surface *surface_object,
+				      unsigned int depth, bool queue)
+{
+	struct object_surface *tail_object;
+	struct epoll_event event;
+	bool completed = false;
+	VAStatus status;
+	int rc;
+
+	pthread_mutex_lock(&driver_data->queue_mutex);
+
+	/*
+	 * Wait for the oldest request to complete when the pipeline of the
+	 * context is full. Requests complete in order, so this retires the
+	 * requests of other contexts queued before ours as well.
+	 */
+	while (context_object->queued_count >= depth) {
+		rc = surface_request_wait_oldest(driver_data);
+		if (rc < 0) {
+			status = VA_STATUS_ERROR_OPERATION_FAILED;
+			goto complete;
+		}
 	}
 
-	request_fd = surface_object->request_fd;
-	if (request_fd < 0) {
-		status = VA_STATUS_ERROR_OPERATION_FAILED;
-		goto error;
+	if (queue) {
+		rc = surface_request_submit(driver_data, surface_object);
+		if (rc < 0) {
+			status = VA_STATUS_ERROR_OPERATION_FAILED;
+			goto complete;
+		}
 	}
 
-	rc = media_request_queue(request_fd);
+	/*
+	 * Requests that are not queued poll with EPOLLERR, so only watch the
+	 * request once it is queued. A request that already completed is
+	 * reported right away.
+	 */
+	memset(&event, 0, sizeof(event));
+	event.events = EPOLLPRI;
+	event.data.u32 = surface_object->base.id;
+
+	rc = epoll_ctl(driver_data->reactor_epoll_fd, EPOLL_CTL_ADD,
+		       surface_object->request_fd, &event);
 	if (rc < 0) {
-		status = VA_STATUS_ERROR_OPERATION_FAILED;
-		goto error;
+		request_log("Unable to watch media request: %s\n",
+			    strerror(errno));
+
+		/* The queued request still has to be retired in order. */
+		rc = media_request_wait_completion(surface_object->request_fd);
+		if (rc >= 0)
+			completed = true;
 	}
 
-	rc = media_request_wait_completion(request_fd);
-	if (rc < 0) {
-		status = VA_STATUS_ERROR_OPERATION_FAILED;
-		goto error;
+	tail_object = SURFACE(driver_data, driver_data->queued_tail_id);
+	if (tail_object != NULL)
+		tail_object->queued_next_id = surface_object->base.id;
+	else
+		driver_data->queued_head_id = surface_object->base.id;
+
+	driver_data->queued_tail_id = surface_object->base.id;
+	context_object->queued_count++;
+
+	surface_object->queued_next_id = VA_INVALID_ID;
+	surface_object->queued_context_id = context_object->base.id;
+	surface_object->request_queued = true;
+	surface_object->request_completed = completed;
+
+	if (completed)
+		surface_request_retire(driver_data);
+
+	status = VA_STATUS_SUCCESS;
+
+complete:
+	pthread_mutex_unlock(&driver_data->queue_mutex);
+
+	return status;
+}
+
+VAStatus surface_request_queue(struct request_data *driver_data,
+			       struct object_context *context_object,
+			       struct object_surface *surface_object)
+{
+	return surface_request_track(driver_data, context_object,
+				     surface_object,
+				     context_object->pipeline_depth, true);
+}
+
+/* Track the completion of a request that was already queued. */
+VAStatus surface_request_watch(struct request_data *driver_data,
+			       struct object_context *context_object,
+			       struct object_surface *surface_object)
+{
+	return surface_request_track(driver_data, context_object,
+				     surface_object, UINT_MAX, false);
+}
+
+static void *surface_reactor(void *data)
+{
+	struct request_data *driver_data = data;
+	struct epoll_event events[SURFACE_REACTOR_EVENTS];
+	struct object_surface *surface_object;
+	bool running = true;
+	int count;
+	int i;
+
+	while (running) {
+		count = epoll_wait(driver_data->reactor_epoll_fd, events,
+				   SURFACE_REACTOR_EVENTS, -1);
+		if (count < 0) {
+			if (errno == EINTR)
+				continue;
+
+			request_log("Unable to wait for media requests: %s\n",
+				    strerror(errno));
+			break;
+		}
+
+		pthread_mutex_lock(&driver_data->queue_mutex);
+
+		for (i = 0; i < count; i++) {
+			if (events[i].data.u32 == VA_INVALID_ID) {
+				running = false;
+				continue;
+			}
+
+			surface_object = SURFACE(driver_data,
+						 events[i].data.u32);
+			if (surface_object == NULL ||
+			    !surface_object->request_queued)
+				continue;
+
+			epoll_ctl(driver_data->reactor_epoll_fd, EPOLL_CTL_DEL,
+				  surface_object->request_fd, NULL);
+
+			/*
+			 * Errors are reported even when not asked for and do
+			 * not mean that the request is done with its buffers.
+			 */
+			if (!(events[i].events & EPOLLPRI)) {
+				request_log("Error polling media request for surface %#x\n",
+					    surface_object->base.id);
+				continue;
+			}
+
+			surface_object->request_completed = true;
+		}
+
+		surface_request_retire(driver_data);
+
+		pthread_mutex_unlock(&driver_data->queue_mutex);
 	}
 
-	rc = media_request_reinit(request_fd);
-	if (rc < 0) {
-		status = VA_STATUS_ERROR_OPERATION_FAILED;
-		goto error;
+	return NULL;
+}
+
+int surface_reactor_start(struct request_data *driver_data)
+{
+	struct epoll_event event;
+	int rc;
+
+	driver_data->reactor_epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	if (driver_data->reactor_epoll_fd < 0) {
+		request_log("Unable to create epoll instance: %s\n",
+			    strerror(errno));
+		return -1;
 	}
 
-	rc = v4l2_dequeue_buffer(driver_data->video_fd, -1, output_type,
-				 surface_object->source_index, 1);
-	if (rc < 0) {
-		status = VA_STATUS_ERROR_OPERATION_FAILED;
+	driver_data->reactor_event_fd = eventfd(0, EFD_CLOEXEC);
+	if (driver_data->reactor_event_fd < 0) {
+		request_log("Unable to create event fd: %s\n",
+			    strerror(errno));
 		goto error;
 	}
 
-	rc = v4l2_dequeue_buffer(driver_data->video_fd, -1, capture_type,
-				 surface_object->destination_index,
-				 surface_object->destination_buffers_count);
+	memset(&event, 0, sizeof(event));
+	event.events = EPOLLIN;
+	event.data.u32 = VA_INVALID_ID;
+
+	rc = epoll_ctl(driver_data->reactor_epoll_fd, EPOLL_CTL_ADD,
+		       driver_data->reactor_event_fd, &event);
 	if (rc < 0) {
-		status = VA_STATUS_ERROR_OPERATION_FAILED;
+		request_log("Unable to watch event fd: %s\n", strerror(errno));
 		goto error;
 	}
 
-	surface_object->status = VASurfaceDisplaying;
+	rc = pthread_create(&driver_data->reactor_thread, NULL,
+			    surface_reactor, driver_data);
+	if (rc != 0) {
+		request_log("Unable to create reactor thread: %s\n",
+			    strerror(rc));
+		goto error;
+	}
 
-	status = VA_STATUS_SUCCESS;
-	goto complete;
+	return 0;
 
 error:
-	if (request_fd >= 0) {
-		close(request_fd);
-		surface_object->request_fd = -1;
+	if (driver_data->reactor_event_fd >= 0)
+		close(driver_data->reactor_event_fd);
+
+	close(driver_data->reactor_epoll_fd);
+
+	driver_data->reactor_event_fd = -1;
+	driver_data->reactor_epoll_fd = -1;
+
+	return -1;
+}
+
+void surface_reactor_stop(struct request_data *driver_data)
+{
+	uint64_t value = 1;
+	ssize_t written;
+
+	if (driver_data->reactor_epoll_fd < 0)
+		return;
+
+	written = write(driver_data->reactor_event_fd, &value, sizeof(value));
+	if (written == sizeof(value))
+		pthread_join(driver_data->reactor_thread, NULL);
+	else
+		request_log("Unable to stop reactor thread: %s\n",
+			    strerror(errno));
+
+	close(driver_data->reactor_event_fd);
+	close(driver_data->reactor_epoll_fd);
+
+	driver_data->reactor_event_fd = -1;
+	driver_data->reactor_epoll_fd = -1;
+}
+
+VAStatus RequestSyncSurface(VADriverContextP context, VASurfaceID surface_id)
+{
+	struct request_data *driver_data = context->pDriverData;
+	struct object_surface *surface_object;
+	VAStatus status;
+	int rc;
+
+	if (driver_data->video_format == NULL)
+		return VA_STATUS_ERROR_OPERATION_FAILED;
+
+	surface_object = SURFACE(driver_data, surface_id);
+	if (surface_object == NULL)
+		return VA_STATUS_ERROR_INVALID_SURFACE;
+
+	pthread_mutex_lock(&driver_data->queue_mutex);
+
+	if (surface_object->status != VASurfaceRendering) {
+		status = VA_STATUS_SUCCESS;
+		goto complete;
+	}
+
+	/* The picture was begun but never submitted with EndPicture. */
+	if (!surface_object->request_queued) {
+		status = VA_STATUS_ERROR_OPERATION_FAILED;
+		goto complete;
+	}
+
+	rc = surface_request_wait(driver_data, surface_object);
+	if (rc < 0) {
+		status = VA_STATUS_ERROR_OPERATION_FAILED;
+		goto complete;
 	}
 
+	/* The reactor leaves the surface rendering when completion failed. */
+	if (surface_object->status != VASurfaceDisplaying)
+		status = VA_STATUS_ERROR_OPERATION_FAILED;
+	else
+		status = VA_STATUS_SUCCESS;
+
 complete:
+	pthread_mutex_unlock(&driver_data->queue_mutex);
+
 	return status;
 }
 
@@ -390,6 +1151,11 @@ VAStatus RequestQuerySurfaceAttributes(VADriverContextP context,
 	attributes_list[i].value.value.i = memory_types;
 	i++;
 
+	attributes_list[i].type = VASurfaceAttribExternalBufferDescriptor;
+	attributes_list[i].flags = VA_SURFACE_ATTRIB_SETTABLE;
+	attributes_list[i].value.type = VAGenericValueTypePointer;
+	i++;
+
 	attributes_list_size = i * sizeof(*attributes);
 
 	if (attributes != NULL)
@@ -445,6 +1211,75 @@ VAStatus RequestUnlockSurface(VADriverContextP context, VASurfaceID surface_id)
 	return VA_STATUS_ERROR_UNIMPLEMENTED;
 }
 
+/*
+ * Get file descriptors for the buffers of a surface, that the caller owns.
+ * Buffers are exported once and kept with the surface, like imported ones,
+ * and duplicates are handed out so that every export of a surface refers to
+ * the same DMABUF objects and consumers can keep their imports.
+ */
+int surface_export_buffers(struct request_data *driver_data,
+			   struct object_surface *surface_object,
+			   int *export_fds, unsigned int export_fds_count)
+{
+	struct video_format *video_format = driver_data->video_format;
+	unsigned int capture_type;
+	unsigned int i;
+	int rc;
+
+	for (i = 0; i < export_fds_count; i++)
+		export_fds[i] = -1;
+
+	if (export_fds_count > surface_object->destination_buffers_count)
+		return -1;
+
+	/* Concurrent exports must not both fill the cached fds. */
+	pthread_mutex_lock(&driver_data->surfaces_mapped_mutex);
+
+	if (surface_object->destination_fds[0] < 0) {
+		capture_type = v4l2_type_video_capture(video_format->v4l2_mplane);
+
+		rc = v4l2_export_buffer(driver_data->video_fd, capture_type,
+					surface_object->destination_index,
+					O_RDONLY, surface_object->destination_fds,
+					surface_object->destination_buffers_count);
+		if (rc < 0) {
+			for (i = 0; i < VIDEO_MAX_PLANES; i++) {
+				if (surface_object->destination_fds[i] >= 0)
+					close(surface_object->destination_fds[i]);
+
+				surface_object->destination_fds[i] = -1;
+			}
+
+			goto error;
+		}
+	}
+
+	for (i = 0; i < export_fds_count; i++) {
+		export_fds[i] = dup(surface_object->destination_fds[i]);
+		if (export_fds[i] < 0) {
+			request_log("Unable to duplicate buffer: %s\n",
+				    strerror(errno));
+			goto error;
+		}
+	}
+
+	pthread_mutex_unlock(&driver_data->surfaces_mapped_mutex);
+
+	return 0;
+
+error:
+	pthread_mutex_unlock(&driver_data->surfaces_mapped_mutex);
+
+	for (i = 0; i < export_fds_count; i++) {
+		if (export_fds[i] >= 0)
+			close(export_fds[i]);
+
+		export_fds[i] = -1;
+	}
+
+	return -1;
+}
+
 VAStatus RequestExportSurfaceHandle(VADriverContextP context,
 				    VASurfaceID surface_id, uint32_t mem_type,
 				    uint32_t flags, void *descriptor)
@@ -456,7 +1291,6 @@ VAStatus RequestExportSurfaceHandle(VADriverContextP context,
 	int *export_fds = NULL;
 	unsigned int export_fds_count;
 	unsigned int planes_count;
-	unsigned int capture_type;
 	unsigned int size;
 	unsigned int i;
 	VAStatus status;
@@ -473,14 +1307,19 @@ VAStatus RequestExportSurfaceHandle(VADriverContextP context,
 	if (surface_object == NULL)
 		return VA_STATUS_ERROR_INVALID_SURFACE;
 
+	if (surface_object->status == VASurfaceRendering) {
+		status = RequestSyncSurface(context, surface_id);
+		if (status != VA_STATUS_SUCCESS)
+			return status;
+	}
+
 	export_fds_count = surface_object->destination_buffers_count;
 	export_fds = malloc(export_fds_count * sizeof(*export_fds));
+	if (export_fds == NULL)
+		return VA_STATUS_ERROR_ALLOCATION_FAILED;
 
-	capture_type = v4l2_type_video_capture(video_format->v4l2_mplane);
-
-	rc = v4l2_export_buffer(driver_data->video_fd, capture_type,
-				surface_object->destination_index, O_RDONLY,
-				export_fds, export_fds_count);
+	rc = surface_export_buffers(driver_data, surface_object, export_fds,
+				    export_fds_count);
 	if (rc < 0) {
 		status = VA_STATUS_ERROR_OPERATION_FAILED;
 		goto error;
@@ -26,64 +26,104 @@
 #ifndef _SURFACE_H_
 #define _SURFACE_H_
 
+#include <pthread.h>
+
+#include <sys/time.h>
+
 #include <linux/videodev2.h>
 
 #include <va/va_backend.h>
 
 #include "object_heap.h"
 
+struct object_buffer;
+struct object_context;
+struct request_data;
+
 #define SURFACE(data, id)                                                      \
 	((struct object_surface *)object_heap_lookup(&(data)->surface_heap, id))
 #define SURFACE_ID_OFFSET		0x04000000
+#define SURFACE_HEAP_PREALLOCATE	32
 
+/*
+ * Fields are grouped by use: request tracking is touched by the reactor and
+ * SyncSurface on every picture and comes first, followed by the picture
+ * state and the destination layout that rarely changes.
+ */
 struct object_surface {
 	struct object_base base;
 
 	VAStatus status;
+	int request_fd;
+	bool request_queued;
+	bool request_completed;
+	VASurfaceID queued_next_id;
+	VAContextID queued_context_id;
+	struct context_source *source;
+	unsigned int destination_index;
+	pthread_cond_t request_cond;
+
+	unsigned int slices_size;
+	unsigned int slices_count;
+
+	/*
+	 * Parameter buffers rendered for the picture, read by the codecs when
+	 * setting controls and referenced until the picture ends. Slice
+	 * parameter buffers are kept in RenderPicture order.
+	 */
+	struct object_buffer *picture_buffer;
+	struct object_buffer *matrix_buffer;
+	struct object_buffer **slice_buffers;
+	unsigned int slice_buffers_count;
+	unsigned int slice_buffers_size;
+	unsigned int slice_params_count;
+
+	/* Slice mode only */
+	unsigned int slice_params_submitted;
+	struct timeval timestamp;
+
 	int width;
 	int height;
 
-	unsigned int source_index;
-	void *source_data;
-	unsigned int source_size;
-
-	unsigned int destination_index;
+	unsigned int destination_memory;
+	int destination_fds[VIDEO_MAX_PLANES];
 	void *destination_map[VIDEO_MAX_PLANES];
 	unsigned int destination_map_lengths[VIDEO_MAX_PLANES];
 	unsigned int destination_map_offsets[VIDEO_MAX_PLANES];
+	unsigned long destination_map_sequence;
+	/* Users pinning the mapping, like derived images pointing to it. */
+	unsigned int destination_map_users;
 	void *destination_data[VIDEO_MAX_PLANES];
 	unsigned int destination_sizes[VIDEO_MAX_PLANES];
 	unsigned int destination_offsets[VIDEO_MAX_PLANES];
 	unsigned int destination_bytesperlines[VIDEO_MAX_PLANES];
 	unsigned int destination_planes_count;
 	unsigned int destination_buffers_count;
-
-	unsigned int slices_size;
-	unsigned int slices_count;
-
-	union {
-		struct {
-			VAPictureParameterBufferMPEG2 picture;
-			VASliceParameterBufferMPEG2 slice;
-			VAIQMatrixBufferMPEG2 iqmatrix;
-			bool iqmatrix_set;
-		} mpeg2;
-		struct {
-			VAIQMatrixBufferH264 matrix;
-			VAPictureParameterBufferH264 picture;
-			VASliceParameterBufferH264 slice;
-		} h264;
-		struct {
-			VAPictureParameterBufferHEVC picture;
-			VASliceParameterBufferHEVC slice;
-			VAIQMatrixBufferHEVC iqmatrix;
-			bool iqmatrix_set;
-		} h265;
-	} params;
-
-	int request_fd;
 };
 
+int surface_map(struct request_data *driver_data,
+		struct object_surface *surface_object);
+void surface_map_release(struct request_data *driver_data,
+			 struct object_surface *surface_object);
+void surface_sync(struct object_surface *surface_object, unsigned int flags);
+int surface_hold_slice_params(struct object_surface *surface_object,
+			      struct object_buffer *buffer_object);
+void surface_release_params(struct request_data *driver_data,
+			    struct object_surface *surface_object);
+int surface_request_wait_oldest(struct request_data *driver_data);
+int surface_request_drain(struct request_data *driver_data);
+VAStatus surface_request_queue(struct request_data *driver_data,
+			       struct object_context *context_object,
+			       struct object_surface *surface_object);
+VAStatus surface_request_watch(struct request_data *driver_data,
+			       struct object_context *context_object,
+			       struct object_surface *surface_object);
+int surface_export_buffers(struct request_data *driver_data,
+			   struct object_surface *surface_object,
+			   int *export_fds, unsigned int export_fds_count);
+int surface_reactor_start(struct request_data *driver_data);
+void surface_reactor_stop(struct request_data *driver_data);
+
 VAStatus RequestCreateSurfaces2(VADriverContextP context, unsigned int format,
 				unsigned int width, unsigned int height,
 				VASurfaceID *surfaces_ids,
@@ -0,0 +1,416 @@
+/*
+ * Copyright (c) 2014 Jens Kuske <jenskuske@gmail.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+/*
+ * Untiling of the Sunxi Video Engine MB32 format: the picture is made of
+ * 32x32 tiles of 1024 bytes each, stored tile row after tile row. Kernels
+ * copy one 32 bytes tile line at a time and the best one available on the
+ * CPU is selected at initialization. The ARMv7 NEON kernels are written in
+ * assembly in tiled_yuv.S.
+ */
+
+#include "tiled_yuv.h"
+
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__arm__)
+#include <sys/auxv.h>
+#include <asm/hwcap.h>
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#elif defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
+#define TILE_SIZE		32
+#define TILE_BYTES		(TILE_SIZE * TILE_SIZE)
+
+/* Linear copies move a cache line at a time, prefetching a few ahead. */
+#define LINEAR_BLOCK_SIZE		64
+#define LINEAR_PREFETCH_DISTANCE	(4 * LINEAR_BLOCK_SIZE)
+
+typedef void (*tiled_to_planar_t)(void *src, void *dst,
+				  unsigned int dst_pitch, unsigned int width,
+				  unsigned int height);
+typedef void (*tiled_deinterleave_to_planar_t)(void *src, void *dst1,
+					       void *dst2,
+					       unsigned int dst_pitch,
+					       unsigned int width,
+					       unsigned int height);
+typedef void (*linear_to_planar_t)(void *src, void *dst, unsigned int size);
+
+/*
+ * Kernels are stamped out from the same loops: only the copy of complete
+ * tile lines differs, partial tiles at the end of lines are copied bytewise.
+ * Lines of the next tile are fetched ahead, like the ARMv7 kernels do.
+ */
+#define TILED_TO_PLANAR(name, attributes, copy_line)			\
+static attributes void name(void *src, void *dst,			\
+			    unsigned int dst_pitch, unsigned int width,	\
+			    unsigned int height)			\
+{									\
+	unsigned int tiles_stride = (width + TILE_SIZE - 1) /		\
+				    TILE_SIZE * TILE_BYTES;		\
+	uint8_t *s, *d;							\
+	unsigned int x, y;						\
+									\
+	for (y = 0; y < height; y++) {					\
+		s = (uint8_t *)src + y / TILE_SIZE * tiles_stride +	\
+		    y % TILE_SIZE * TILE_SIZE;				\
+		d = (uint8_t *)dst + y * dst_pitch;			\
+									\
+		for (x = 0; x + TILE_SIZE <= width; x += TILE_SIZE) {	\
+			__builtin_prefetch(s + TILE_BYTES, 0, 0);	\
+			copy_line(d, s);				\
+			s += TILE_BYTES;				\
+			d += TILE_SIZE;					\
+		}							\
+									\
+		if (x < width)						\
+			memcpy(d, s, width - x);			\
+	}								\
+}
+
+#define TILED_DEINTERLEAVE_TO_PLANAR(name, attributes, copy_line)	\
+static attributes void name(void *src, void *dst1, void *dst2,		\
+			    unsigned int dst_pitch, unsigned int width,	\
+			    unsigned int height)			\
+{									\
+	unsigned int tiles_stride = (width + TILE_SIZE - 1) /		\
+				    TILE_SIZE * TILE_BYTES;		\
+	uint8_t *s, *d1, *d2;						\
+	unsigned int x, y, i;						\
+									\
+	for (y = 0; y < height; y++) {					\
+		s = (uint8_t *)src + y / TILE_SIZE * tiles_stride +	\
+		    y % TILE_SIZE * TILE_SIZE;				\
+		d1 = (uint8_t *)dst1 + y * dst_pitch;			\
+		d2 = (uint8_t *)dst2 + y * dst_pitch;			\
+									\
+		for (x = 0; x + TILE_SIZE <= width; x += TILE_SIZE) {	\
+			__builtin_prefetch(s + TILE_BYTES, 0, 0);	\
+			copy_line(d1, d2, s);				\
+			s += TILE_BYTES;				\
+			d1 += TILE_SIZE / 2;				\
+			d2 += TILE_SIZE / 2;				\
+		}							\
+									\
+		for (i = 0; i < (width - x) / 2; i++) {			\
+			d1[i] = s[2 * i];				\
+			d2[i] = s[2 * i + 1];				\
+		}							\
+	}								\
+}
+
+static inline void copy_line_c(uint8_t *d, uint8_t *s)
+{
+	memcpy(d, s, TILE_SIZE);
+}
+
+static inline void deinterleave_line_c(uint8_t *d1, uint8_t *d2, uint8_t *s)
+{
+	unsigned int i;
+
+	for (i = 0; i < TILE_SIZE / 2; i++) {
+		d1[i] = s[2 * i];
+		d2[i] = s[2 * i + 1];
+	}
+}
+
+TILED_TO_PLANAR(tiled_to_planar_c, , copy_line_c)
+TILED_DEINTERLEAVE_TO_PLANAR(tiled_deinterleave_to_planar_c, ,
+			     deinterleave_line_c)
+
+static void linear_to_planar_c(void *src, void *dst, unsigned int size)
+{
+	memcpy(dst, src, size);
+}
+
+#if defined(__arm__)
+
+void tiled_to_planar_neon(void *src, void *dst, unsigned int dst_pitch,
+			  unsigned int width, unsigned int height);
+void tiled_deinterleave_to_planar_neon(void *src, void *dst1, void *dst2,
+				       unsigned int dst_pitch,
+				       unsigned int width,
+				       unsigned int height);
+
+#elif defined(__aarch64__)
+
+static inline void copy_line_neon(uint8_t *d, uint8_t *s)
+{
+	vst1q_u8(d, vld1q_u8(s));
+	vst1q_u8(d + 16, vld1q_u8(s + 16));
+}
+
+static inline void deinterleave_line_neon(uint8_t *d1, uint8_t *d2,
+					  uint8_t *s)
+{
+	uint8x16x2_t line = vld2q_u8(s);
+
+	vst1q_u8(d1, line.val[0]);
+	vst1q_u8(d2, line.val[1]);
+}
+
+/*
+ * Wide loads make the most of each uncached access and the prefetches are
+ * issued with the streaming hint (PLDL1STRM).
+ */
+static void linear_to_planar_neon(void *src, void *dst, unsigned int size)
+{
+	uint8_t *s = src;
+	uint8_t *d = dst;
+	uint8x16x4_t block;
+
+	for (; size >= LINEAR_BLOCK_SIZE; size -= LINEAR_BLOCK_SIZE) {
+		__builtin_prefetch(s + LINEAR_PREFETCH_DISTANCE, 0, 0);
+
+		block = vld1q_u8_x4(s);
+		vst1q_u8_x4(d, block);
+
+		s += LINEAR_BLOCK_SIZE;
+		d += LINEAR_BLOCK_SIZE;
+	}
+
+	memcpy(d, s, size);
+}
+
+TILED_TO_PLANAR(tiled_to_planar_neon, , copy_line_neon)
+TILED_DEINTERLEAVE_TO_PLANAR(tiled_deinterleave_to_planar_neon, ,
+			     deinterleave_line_neon)
+
+#elif defined(__x86_64__) || defined(__i386__)
+
+static inline __attribute__((target("sse2")))
+void copy_line_sse2(uint8_t *d, uint8_t *s)
+{
+	__m128i a = _mm_loadu_si128((__m128i *)s);
+	__m128i b = _mm_loadu_si128((__m128i *)(s + 16));
+
+	_mm_storeu_si128((__m128i *)d, a);
+	_mm_storeu_si128((__m128i *)(d + 16), b);
+}
+
+static inline __attribute__((target("sse2")))
+void deinterleave_sse2(uint8_t *d1, uint8_t *d2, __m128i a, __m128i b)
+{
+	__m128i mask = _mm_set1_epi16(0x00ff);
+	__m128i even, odd;
+
+	even = _mm_packus_epi16(_mm_and_si128(a, mask),
+				_mm_and_si128(b, mask));
+	odd = _mm_packus_epi16(_mm_srli_epi16(a, 8), _mm_srli_epi16(b, 8));
+
+	_mm_storeu_si128((__m128i *)d1, even);
+	_mm_storeu_si128((__m128i *)d2, odd);
+}
+
+static inline __attribute__((target("sse2")))
+void deinterleave_line_sse2(uint8_t *d1, uint8_t *d2, uint8_t *s)
+{
+	deinterleave_sse2(d1, d2, _mm_loadu_si128((__m128i *)s),
+			  _mm_loadu_si128((__m128i *)(s + 16)));
+}
+
+/*
+ * Streaming loads (MOVNTDQA) read uncached and write-combined memory, such as
+ * capture buffers usually are, a whole line fill buffer at a time instead of
+ * one load at a time. They behave like regular loads on cached memory.
+ */
+static inline __attribute__((target("sse4.1")))
+void copy_line_sse41(uint8_t *d, uint8_t *s)
+{
+	__m128i a = _mm_stream_load_si128((__m128i *)s);
+	__m128i b = _mm_stream_load_si128((__m128i *)(s + 16));
+
+	_mm_storeu_si128((__m128i *)d, a);
+	_mm_storeu_si128((__m128i *)(d + 16), b);
+}
+
+static inline __attribute__((target("sse4.1")))
+void deinterleave_line_sse41(uint8_t *d1, uint8_t *d2, uint8_t *s)
+{
+	deinterleave_sse2(d1, d2, _mm_stream_load_si128((__m128i *)s),
+			  _mm_stream_load_si128((__m128i *)(s + 16)));
+}
+
+static inline __attribute__((target("avx2")))
+void copy_line_avx2(uint8_t *d, uint8_t *s)
+{
+	_mm256_storeu_si256((__m256i *)d,
+			    _mm256_stream_load_si256((__m256i *)s));
+}
+
+static inline __attribute__((target("avx2")))
+void deinterleave_line_avx2(uint8_t *d1, uint8_t *d2, uint8_t *s)
+{
+	__m256i mask = _mm256_set1_epi16(0x00ff);
+	__m256i a = _mm256_stream_load_si256((__m256i *)s);
+	__m256i packed;
+
+	/* Packing works within lanes: gather even and odd halves after. */
+	packed = _mm256_packus_epi16(_mm256_and_si256(a, mask),
+				     _mm256_srli_epi16(a, 8));
+	packed = _mm256_permute4x64_epi64(packed, 0xd8);
+
+	_mm_storeu_si128((__m128i *)d1, _mm256_castsi256_si128(packed));
+	_mm_storeu_si128((__m128i *)d2, _mm256_extracti128_si256(packed, 1));
+}
+
+static __attribute__((target("sse4.1")))
+void linear_to_planar_sse41(void *src, void *dst, unsigned int size)
+{
+	uint8_t *s = src;
+	uint8_t *d = dst;
+	__m128i a, b, c, e;
+
+	for (; size >= LINEAR_BLOCK_SIZE; size -= LINEAR_BLOCK_SIZE) {
+		__builtin_prefetch(s + LINEAR_PREFETCH_DISTANCE, 0, 0);
+
+		a = _mm_stream_load_si128((__m128i *)s);
+		b = _mm_stream_load_si128((__m128i *)(s + 16));
+		c = _mm_stream_load_si128((__m128i *)(s + 32));
+		e = _mm_stream_load_si128((__m128i *)(s + 48));
+
+		_mm_storeu_si128((__m128i *)d, a);
+		_mm_storeu_si128((__m128i *)(d + 16), b);
+		_mm_storeu_si128((__m128i *)(d + 32), c);
+		_mm_storeu_si128((__m128i *)(d + 48), e);
+
+		s += LINEAR_BLOCK_SIZE;
+		d += LINEAR_BLOCK_SIZE;
+	}
+
+	memcpy(d, s, size);
+}
+
+static __attribute__((target("avx2")))
+void linear_to_planar_avx2(void *src, void *dst, unsigned int size)
+{
+	uint8_t *s = src;
+	uint8_t *d = dst;
+	__m256i a, b;
+
+	for (; size >= LINEAR_BLOCK_SIZE; size -= LINEAR_BLOCK_SIZE) {
+		__builtin_prefetch(s + LINEAR_PREFETCH_DISTANCE, 0, 0);
+
+		a = _mm256_stream_load_si256((__m256i *)s);
+		b = _mm256_stream_load_si256((__m256i *)(s + 32));
+
+		_mm256_storeu_si256((__m256i *)d, a);
+		_mm256_storeu_si256((__m256i *)(d + 32), b);
+
+		s += LINEAR_BLOCK_SIZE;
+		d += LINEAR_BLOCK_SIZE;
+	}
+
+	memcpy(d, s, size);
+}
+
+TILED_TO_PLANAR(tiled_to_planar_sse2, __attribute__((target("sse2"))),
+		copy_line_sse2)
+TILED_DEINTERLEAVE_TO_PLANAR(tiled_deinterleave_to_planar_sse2,
+			     __attribute__((target("sse2"))),
+			     deinterleave_line_sse2)
+TILED_TO_PLANAR(tiled_to_planar_sse41, __attribute__((target("sse4.1"))),
+		copy_line_sse41)
+TILED_DEINTERLEAVE_TO_PLANAR(tiled_deinterleave_to_planar_sse41,
+			     __attribute__((target("sse4.1"))),
+			     deinterleave_line_sse41)
+TILED_TO_PLANAR(tiled_to_planar_avx2, __attribute__((target("avx2"))),
+		copy_line_avx2)
+TILED_DEINTERLEAVE_TO_PLANAR(tiled_deinterleave_to_planar_avx2,
+			     __attribute__((target("avx2"))),
+			     deinterleave_line_avx2)
+
+#endif
+
+static tiled_to_planar_t tiled_to_planar_kernel = tiled_to_planar_c;
+static tiled_deinterleave_to_planar_t tiled_deinterleave_to_planar_kernel =
+	tiled_deinterleave_to_planar_c;
+static linear_to_planar_t linear_to_planar_kernel = linear_to_planar_c;
+
+void tiled_yuv_init(void)
+{
+#if defined(__arm__)
+	if (getauxval(AT_HWCAP) & HWCAP_NEON) {
+		tiled_to_planar_kernel = tiled_to_planar_neon;
+		tiled_deinterleave_to_planar_kernel =
+			tiled_deinterleave_to_planar_neon;
+	}
+#elif defined(__aarch64__)
+	/* Advanced SIMD is mandatory on AArch64. */
+	tiled_to_planar_kernel = tiled_to_planar_neon;
+	tiled_deinterleave_to_planar_kernel =
+		tiled_deinterleave_to_planar_neon;
+	linear_to_planar_kernel = linear_to_planar_neon;
+#elif defined(__x86_64__) || defined(__i386__)
+	__builtin_cpu_init();
+
+	if (__builtin_cpu_supports("avx2")) {
+		tiled_to_planar_kernel = tiled_to_planar_avx2;
+		tiled_deinterleave_to_planar_kernel =
+			tiled_deinterleave_to_planar_avx2;
+		linear_to_planar_kernel = linear_to_planar_avx2;
+	} else if (__builtin_cpu_supports("sse4.1")) {
+		tiled_to_planar_kernel = tiled_to_planar_sse41;
+		tiled_deinterleave_to_planar_kernel =
+			tiled_deinterleave_to_planar_sse41;
+		linear_to_planar_kernel = linear_to_planar_sse41;
+	} else if (__builtin_cpu_supports("sse2")) {
+		tiled_to_planar_kernel = tiled_to_planar_sse2;
+		tiled_deinterleave_to_planar_kernel =
+			tiled_deinterleave_to_planar_sse2;
+	}
+#endif
+}
+
+/*
+ * Kernels expect tile-aligned sources, as tiled buffers always are. Streaming
+ * loads fault on unaligned addresses, so anything else goes the slow way.
+ */
+void tiled_to_planar(void *src, void *dst, unsigned int dst_pitch,
+		     unsigned int width, unsigned int height)
+{
+	if ((uintptr_t)src % TILE_SIZE != 0)
+		tiled_to_planar_c(src, dst, dst_pitch, width, height);
+	else
+		tiled_to_planar_kernel(src, dst, dst_pitch, width, height);
+}
+
+void tiled_deinterleave_to_planar(void *src, void *dst1, void *dst2,
+				  unsigned int dst_pitch, unsigned int width,
+				  unsigned int height)
+{
+	if ((uintptr_t)src % TILE_SIZE != 0)
+		tiled_deinterleave_to_planar_c(src, dst1, dst2, dst_pitch,
+					       width, height);
+	else
+		tiled_deinterleave_to_planar_kernel(src, dst1, dst2,
+						    dst_pitch, width, height);
+}
+
+void linear_to_planar(void *src, void *dst, unsigned int size)
+{
+	if ((uintptr_t)src % LINEAR_BLOCK_SIZE != 0)
+		memcpy(dst, src, size);
+	else
+		linear_to_planar_kernel(src, dst, size);
+}
@@ -20,6 +20,8 @@
 #ifndef _TILED_YUV_H_
 #define _TILED_YUV_H_
 
+void tiled_yuv_init(void);
+
 void tiled_to_planar(void *src, void *dst, unsigned int dst_pitch,
 		     unsigned int width, unsigned int height);
 
@@ -27,4 +29,6 @@ void tiled_deinterleave_to_planar(void *src, void *dst1, void *dst2,
 				  unsigned int dst_pitch, unsigned int width,
 				  unsigned int height);
 
+void linear_to_planar(void *src, void *dst, unsigned int size);
+
 #endif
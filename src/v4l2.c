@@ -91,15 +91,11 @@ int v4l2_query_capabilities(int video_fd, unsigned int *capabilities)
 
 static void v4l2_setup_format(struct v4l2_format *format, unsigned int type,
 			      unsigned int width, unsigned int height,
-			      unsigned int pixelformat)
+			      unsigned int pixelformat, unsigned int sizeimage)
 {
-	unsigned int sizeimage;
-
 	memset(format, 0, sizeof(*format));
 	format->type = type;
 
-	sizeimage = v4l2_type_is_output(type) ? SOURCE_SIZE_MAX : 0;
-
 	if (v4l2_type_is_mplane(type)) {
 		format->fmt.pix_mp.width = width;
 		format->fmt.pix_mp.height = height;
@@ -142,7 +138,8 @@ int v4l2_try_format(int video_fd, unsigned int type, unsigned int width,
 	struct v4l2_format format;
 	int rc;
 
-	v4l2_setup_format(&format, type, width, height, pixelformat);
+	v4l2_setup_format(&format, type, width, height, pixelformat,
+			  v4l2_type_is_output(type) ? SOURCE_SIZE_MAX : 0);
 
 	rc = ioctl(video_fd, VIDIOC_TRY_FMT, &format);
 	if (rc < 0) {
@@ -155,12 +152,14 @@ int v4l2_try_format(int video_fd, unsigned int type, unsigned int width,
 }
 
 int v4l2_set_format(int video_fd, unsigned int type, unsigned int pixelformat,
-		    unsigned int width, unsigned int height)
+		    unsigned int width, unsigned int height,
+		    unsigned int sizeimage)
 {
 	struct v4l2_format format;
 	int rc;
 
-	v4l2_setup_format(&format, type, width, height, pixelformat);
+	v4l2_setup_format(&format, type, width, height, pixelformat,
+			  sizeimage);
 
 	rc = ioctl(video_fd, VIDIOC_S_FMT, &format);
 	if (rc < 0) {
@@ -235,15 +234,16 @@ int v4l2_get_format(int video_fd, unsigned int type, unsigned int *width,
 	return 0;
 }
 
-int v4l2_create_buffers(int video_fd, unsigned int type,
-			unsigned int buffers_count, unsigned int *index_base)
+int v4l2_create_buffers(int video_fd, unsigned int type, unsigned int memory,
+			unsigned int buffers_count, unsigned int size,
+			unsigned int *index_base, unsigned int *capabilities)
 {
 	struct v4l2_create_buffers buffers;
 	int rc;
 
 	memset(&buffers, 0, sizeof(buffers));
 	buffers.format.type = type;
-	buffers.memory = V4L2_MEMORY_MMAP;
+	buffers.memory = memory;
 	buffers.count = buffers_count;
 
 	rc = ioctl(video_fd, VIDIOC_G_FMT, &buffers.format);
@@ -253,6 +253,14 @@ int v4l2_create_buffers(int video_fd, unsigned int type,
 		return -1;
 	}
 
+	/* Buffers can be made larger than what the format requires. */
+	if (size > 0) {
+		if (v4l2_type_is_mplane(type))
+			buffers.format.fmt.pix_mp.plane_fmt[0].sizeimage = size;
+		else
+			buffers.format.fmt.pix.sizeimage = size;
+	}
+
 	rc = ioctl(video_fd, VIDIOC_CREATE_BUFS, &buffers);
 	if (rc < 0) {
 		request_log("Unable to create buffer for type %d: %s\n", type,
@@ -263,6 +271,9 @@ int v4l2_create_buffers(int video_fd, unsigned int type,
 	if (index_base != NULL)
 		*index_base = buffers.index;
 
+	if (capabilities != NULL)
+		*capabilities = buffers.capabilities;
+
 	return 0;
 }
 
@@ -330,8 +341,9 @@ int v4l2_request_buffers(int video_fd, unsigned int type,
 }
 
 int v4l2_queue_buffer(int video_fd, int request_fd, unsigned int type,
-		      unsigned int index, unsigned int size,
-		      unsigned int buffers_count)
+		      unsigned int memory, struct timeval *timestamp,
+		      unsigned int index, int *fds, unsigned int size,
+		      unsigned int buffers_count, unsigned int flags)
 {
 	struct v4l2_plane planes[buffers_count];
 	struct v4l2_buffer buffer;
@@ -342,10 +354,14 @@ int v4l2_queue_buffer(int video_fd, int request_fd, unsigned int type,
 	memset(&buffer, 0, sizeof(buffer));
 
 	buffer.type = type;
-	buffer.memory = V4L2_MEMORY_MMAP;
+	buffer.memory = memory;
 	buffer.index = index;
 	buffer.length = buffers_count;
 	buffer.m.planes = planes;
+	buffer.flags = flags;
+
+	if (timestamp != NULL)
+		buffer.timestamp = *timestamp;
 
 	for (i = 0; i < buffers_count; i++)
 		if (v4l2_type_is_mplane(type))
@@ -353,8 +369,17 @@ int v4l2_queue_buffer(int video_fd, int request_fd, unsigned int type,
 		else
 			buffer.bytesused = size;
 
+	/* Imported buffers are given with each queueing. */
+	if (memory == V4L2_MEMORY_DMABUF && fds != NULL) {
+		for (i = 0; i < buffers_count; i++)
+			if (v4l2_type_is_mplane(type))
+				buffer.m.planes[i].m.fd = fds[i];
+			else
+				buffer.m.fd = fds[0];
+	}
+
 	if (request_fd >= 0) {
-		buffer.flags = V4L2_BUF_FLAG_REQUEST_FD;
+		buffer.flags |= V4L2_BUF_FLAG_REQUEST_FD;
 		buffer.request_fd = request_fd;
 	}
 
@@ -367,8 +392,54 @@ int v4l2_queue_buffer(int video_fd, int request_fd, unsigned int type,
 	return 0;
 }
 
+/*
+ * Prepare a buffer without queueing it, which checks that the device can
+ * access imported memory.
+ */
+int v4l2_prepare_buffer(int video_fd, unsigned int type, unsigned int memory,
+			unsigned int index, int *fds, unsigned int size,
+			unsigned int buffers_count)
+{
+	struct v4l2_plane planes[buffers_count];
+	struct v4l2_buffer buffer;
+	unsigned int i;
+	int rc;
+
+	memset(planes, 0, sizeof(planes));
+	memset(&buffer, 0, sizeof(buffer));
+
+	buffer.type = type;
+	buffer.memory = memory;
+	buffer.index = index;
+	buffer.length = buffers_count;
+	buffer.m.planes = planes;
+
+	for (i = 0; i < buffers_count; i++)
+		if (v4l2_type_is_mplane(type))
+			buffer.m.planes[i].bytesused = size;
+		else
+			buffer.bytesused = size;
+
+	if (memory == V4L2_MEMORY_DMABUF && fds != NULL) {
+		for (i = 0; i < buffers_count; i++)
+			if (v4l2_type_is_mplane(type))
+				buffer.m.planes[i].m.fd = fds[i];
+			else
+				buffer.m.fd = fds[0];
+	}
+
+	rc = ioctl(video_fd, VIDIOC_PREPARE_BUF, &buffer);
+	if (rc < 0) {
+		request_log("Unable to prepare buffer: %s\n", strerror(errno));
+		return -1;
+	}
+
+	return 0;
+}
+
 int v4l2_dequeue_buffer(int video_fd, int request_fd, unsigned int type,
-			unsigned int index, unsigned int buffers_count)
+			unsigned int memory, unsigned int index,
+			unsigned int buffers_count)
 {
 	struct v4l2_plane planes[buffers_count];
 	struct v4l2_buffer buffer;
@@ -378,7 +449,7 @@ int v4l2_dequeue_buffer(int video_fd, int request_fd, unsigned int type,
 	memset(&buffer, 0, sizeof(buffer));
 
 	buffer.type = type;
-	buffer.memory = V4L2_MEMORY_MMAP;
+	buffer.memory = memory;
 	buffer.index = index;
 	buffer.length = buffers_count;
 	buffer.m.planes = planes;
@@ -394,6 +465,13 @@ int v4l2_dequeue_buffer(int video_fd, int request_fd, unsigned int type,
 		return -1;
 	}
 
+	/* The oldest done buffer is dequeued, whatever the index asked. */
+	if (buffer.index != index) {
+		request_log("Dequeued buffer %u instead of %u\n", buffer.index,
+			    index);
+		return -1;
+	}
+
 	return 0;
 }
 
@@ -425,22 +503,37 @@ int v4l2_export_buffer(int video_fd, unsigned int type, unsigned int index,
 	return 0;
 }
 
-int v4l2_set_control(int video_fd, int request_fd, unsigned int id, void *data,
-		     unsigned int size)
+int v4l2_query_control(int video_fd, unsigned int id, unsigned int *elems)
+{
+	struct v4l2_query_ext_ctrl query;
+	int rc;
+
+	memset(&query, 0, sizeof(query));
+	query.id = id;
+
+	rc = ioctl(video_fd, VIDIOC_QUERY_EXT_CTRL, &query);
+	if (rc < 0) {
+		request_log("Unable to query control: %s\n", strerror(errno));
+		return -1;
+	}
+
+	if (elems != NULL)
+		*elems = query.elems;
+
+	return 0;
+}
+
+int v4l2_set_controls(int video_fd, int request_fd,
+		      struct v4l2_ext_control *control_array,
+		      unsigned int count)
 {
-	struct v4l2_ext_control control;
 	struct v4l2_ext_controls controls;
 	int rc;
 
-	memset(&control, 0, sizeof(control));
 	memset(&controls, 0, sizeof(controls));
 
-	control.id = id;
-	control.ptr = data;
-	control.size = size;
-
-	controls.controls = &control;
-	controls.count = 1;
+	controls.controls = control_array;
+	controls.count = count;
 
 	if (request_fd >= 0) {
 		controls.which = V4L2_CTRL_WHICH_REQUEST_VAL;
@@ -449,7 +542,179 @@ int v4l2_set_control(int video_fd, int request_fd, unsigned int id, void *data,
 
 	rc = ioctl(video_fd, VIDIOC_S_EXT_CTRLS, &controls);
 	if (rc < 0) {
-		request_log("Unable to set control: %s\n", strerror(errno));
+		if (controls.error_idx < count)
+			request_log("Unable to set control %#x: %s\n",
+				    control_array[controls.error_idx].id,
+				    strerror(errno));
+		else
+			request_log("Unable to set controls: %s\n",
+				    strerror(errno));
+
+		return -1;
+	}
+
+	return 0;
+}
+
+static int v4l2_control_cache_find(struct v4l2_control_cache *cache,
+				   unsigned int id)
+{
+	unsigned int i;
+
+	for (i = 0; i < cache->entries_count; i++)
+		if (cache->entries[i].id == id)
+			return i;
+
+	return -1;
+}
+
+static void v4l2_control_cache_store(struct v4l2_control_cache *cache,
+				     struct v4l2_ext_control *control)
+{
+	void *data;
+	int i;
+
+	i = v4l2_control_cache_find(cache, control->id);
+	if (i < 0) {
+		if (cache->entries_count == V4L2_CONTROL_CACHE_SIZE)
+			return;
+
+		i = cache->entries_count++;
+		cache->entries[i].id = control->id;
+		cache->entries[i].size = 0;
+		cache->entries[i].data = NULL;
+	}
+
+	if (cache->entries[i].size != control->size) {
+		data = realloc(cache->entries[i].data, control->size);
+		if (data == NULL) {
+			/* Never skip a control whose value was not kept. */
+			cache->entries[i].size = 0;
+			return;
+		}
+
+		cache->entries[i].data = data;
+		cache->entries[i].size = control->size;
+	}
+
+	memcpy(cache->entries[i].data, control->ptr, control->size);
+}
+
+static void v4l2_control_cache_clear(struct v4l2_control_cache *cache)
+{
+	unsigned int i;
+
+	for (i = 0; i < cache->entries_count; i++)
+		free(cache->entries[i].data);
+
+	cache->entries_count = 0;
+}
+
+int v4l2_set_controls_cached(int video_fd, int request_fd,
+			     struct v4l2_control_cache *cache,
+			     struct v4l2_ext_control *control_array,
+			     unsigned int count)
+{
+	struct v4l2_ext_control changed[V4L2_CONTROL_CACHE_SIZE];
+	unsigned int changed_count = 0;
+	unsigned int i;
+	int index;
+	int rc = 0;
+
+	pthread_mutex_lock(&cache->mutex);
+
+	/*
+	 * Controls that do not fit are not tracked, so the cached values may
+	 * no longer match the device once they are set.
+	 */
+	if (count > V4L2_CONTROL_CACHE_SIZE) {
+		v4l2_control_cache_clear(cache);
+
+		rc = v4l2_set_controls(video_fd, request_fd, control_array,
+				       count);
+		goto complete;
+	}
+
+	for (i = 0; i < count; i++) {
+		index = v4l2_control_cache_find(cache, control_array[i].id);
+		if (index >= 0 &&
+		    cache->entries[index].size == control_array[i].size &&
+		    memcmp(cache->entries[index].data, control_array[i].ptr,
+			   control_array[i].size) == 0) {
+			cache->skipped_controls++;
+			cache->skipped_bytes += control_array[i].size;
+			continue;
+		}
+
+		changed[changed_count++] = control_array[i];
+	}
+
+	if (changed_count == 0)
+		goto complete;
+
+	rc = v4l2_set_controls(video_fd, request_fd, changed, changed_count);
+	if (rc < 0) {
+		v4l2_control_cache_clear(cache);
+		rc = -1;
+		goto complete;
+	}
+
+	for (i = 0; i < changed_count; i++) {
+		v4l2_control_cache_store(cache, &changed[i]);
+
+		cache->submitted_controls++;
+		cache->submitted_bytes += changed[i].size;
+	}
+
+complete:
+	pthread_mutex_unlock(&cache->mutex);
+
+	return rc;
+}
+
+void v4l2_control_cache_init(struct v4l2_control_cache *cache)
+{
+	pthread_mutex_init(&cache->mutex, NULL);
+}
+
+void v4l2_control_cache_invalidate(struct v4l2_control_cache *cache)
+{
+	pthread_mutex_lock(&cache->mutex);
+	v4l2_control_cache_clear(cache);
+	pthread_mutex_unlock(&cache->mutex);
+}
+
+void v4l2_control_cache_destroy(struct v4l2_control_cache *cache)
+{
+	v4l2_control_cache_clear(cache);
+	pthread_mutex_destroy(&cache->mutex);
+}
+
+int v4l2_set_control(int video_fd, int request_fd, unsigned int id, void *data,
+		     unsigned int size)
+{
+	struct v4l2_ext_control control;
+
+	memset(&control, 0, sizeof(control));
+
+	control.id = id;
+	control.ptr = data;
+	control.size = size;
+
+	return v4l2_set_controls(video_fd, request_fd, &control, 1);
+}
+
+int v4l2_decoder_flush(int video_fd)
+{
+	struct v4l2_decoder_cmd command;
+	int rc;
+
+	memset(&command, 0, sizeof(command));
+	command.cmd = V4L2_DEC_CMD_FLUSH;
+
+	rc = ioctl(video_fd, VIDIOC_DECODER_CMD, &command);
+	if (rc < 0) {
+		request_log("Unable to flush decoder: %s\n", strerror(errno));
 		return -1;
 	}
 
@@ -25,37 +25,84 @@
 #ifndef _V4L2_H_
 #define _V4L2_H_
 
+#include <pthread.h>
 #include <stdbool.h>
 
+#include <sys/time.h>
+
+#define SOURCE_SIZE_MIN						(64 * 1024)
 #define SOURCE_SIZE_MAX						(1024 * 1024)
 
+#define V4L2_CONTROL_CACHE_SIZE					8
+
+struct v4l2_ext_control;
+
+/*
+ * Last value committed for each control, so that unchanged controls can be
+ * left out of a request and inherited from the previous one instead.
+ */
+struct v4l2_control_cache {
+	/* Contexts set controls concurrently. */
+	pthread_mutex_t mutex;
+	struct {
+		unsigned int id;
+		unsigned int size;
+		void *data;
+	} entries[V4L2_CONTROL_CACHE_SIZE];
+	unsigned int entries_count;
+
+	unsigned long submitted_controls;
+	unsigned long submitted_bytes;
+	unsigned long skipped_controls;
+	unsigned long skipped_bytes;
+};
+
 unsigned int v4l2_type_video_output(bool mplane);
 unsigned int v4l2_type_video_capture(bool mplane);
 int v4l2_query_capabilities(int video_fd, unsigned int *capabilities);
 bool v4l2_find_format(int video_fd, unsigned int type,
 		      unsigned int pixelformat);
 int v4l2_set_format(int video_fd, unsigned int type, unsigned int pixelformat,
-		    unsigned int width, unsigned int height);
+		    unsigned int width, unsigned int height,
+		    unsigned int sizeimage);
 int v4l2_get_format(int video_fd, unsigned int type, unsigned int *width,
 		    unsigned int *height, unsigned int *bytesperline,
 		    unsigned int *sizes, unsigned int *planes_count);
-int v4l2_create_buffers(int video_fd, unsigned int type,
-			unsigned int buffers_count, unsigned int *index_base);
+int v4l2_create_buffers(int video_fd, unsigned int type, unsigned int memory,
+			unsigned int buffers_count, unsigned int size,
+			unsigned int *index_base, unsigned int *capabilities);
 int v4l2_query_buffer(int video_fd, unsigned int type, unsigned int index,
 		      unsigned int *lengths, unsigned int *offsets,
 		      unsigned int buffers_count);
 int v4l2_request_buffers(int video_fd, unsigned int type,
 			 unsigned int buffers_count);
 int v4l2_queue_buffer(int video_fd, int request_fd, unsigned int type,
-		      unsigned int index, unsigned int size,
-		      unsigned int buffers_count);
+		      unsigned int memory, struct timeval *timestamp,
+		      unsigned int index, int *fds, unsigned int size,
+		      unsigned int buffers_count, unsigned int flags);
+int v4l2_prepare_buffer(int video_fd, unsigned int type, unsigned int memory,
+			unsigned int index, int *fds, unsigned int size,
+			unsigned int buffers_count);
 int v4l2_dequeue_buffer(int video_fd, int request_fd, unsigned int type,
-			unsigned int index, unsigned int buffers_count);
+			unsigned int memory, unsigned int index,
+			unsigned int buffers_count);
 int v4l2_export_buffer(int video_fd, unsigned int type, unsigned int index,
 		       unsigned int flags, int *export_fds,
 		       unsigned int export_fds_count);
+int v4l2_query_control(int video_fd, unsigned int id, unsigned int *elems);
+int v4l2_set_controls(int video_fd, int request_fd,
+		      struct v4l2_ext_control *control_array,
+		      unsigned int count);
+int v4l2_set_controls_cached(int video_fd, int request_fd,
+			     struct v4l2_control_cache *cache,
+			     struct v4l2_ext_control *control_array,
+			     unsigned int count);
+void v4l2_control_cache_init(struct v4l2_control_cache *cache);
+void v4l2_control_cache_invalidate(struct v4l2_control_cache *cache);
+void v4l2_control_cache_destroy(struct v4l2_control_cache *cache);
 int v4l2_set_control(int video_fd, int request_fd, unsigned int id, void *data,
 		     unsigned int size);
+int v4l2_decoder_flush(int video_fd);
 int v4l2_set_stream(int video_fd, unsigned int type, bool enable);
 
 #endif
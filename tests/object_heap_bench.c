@@ -0,0 +1,168 @@
+/*
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sub license, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial portions
+ * of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NON-INFRINGEMENT.
+ * IN NO EVENT SHALL PRECISION INSIGHT AND/OR ITS SUPPLIERS BE LIABLE FOR
+ * ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * Measure object lookups from several threads while another thread keeps
+ * allocating and freeing objects in the same heap, like VA entry points do
+ * next to the reactor and the copy workers. Lookups always target live
+ * objects and must never fail.
+ */
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+/* The heap is built along with the benchmark, like the backend builds it. */
+#include "object_heap.c"
+
+#define BENCH_ID_OFFSET		0x04000000
+#define BENCH_OBJECTS_COUNT	64
+#define BENCH_THREADS_MAX	64
+#define BENCH_DURATION_S	1
+
+struct bench_object {
+	struct object_base base;
+	int value;
+};
+
+struct bench_thread {
+	pthread_t thread;
+	struct object_heap *heap;
+	int *ids;
+	unsigned long long count;
+	bool failed;
+};
+
+static bool running = true;
+
+static void *bench_lookup(void *data)
+{
+	struct bench_thread *thread = data;
+	struct bench_object *object;
+	unsigned long long count = 0;
+	unsigned int i = 0;
+
+	while (__atomic_load_n(&running, __ATOMIC_RELAXED)) {
+		object = (struct bench_object *)
+			object_heap_lookup(thread->heap,
+					   thread->ids[i++ % BENCH_OBJECTS_COUNT]);
+		if (object == NULL || object->value != object->base.id)
+			thread->failed = true;
+
+		count++;
+	}
+
+	thread->count = count;
+
+	return NULL;
+}
+
+static void *bench_churn(void *data)
+{
+	struct bench_thread *thread = data;
+	struct object_base *object;
+	unsigned long long count = 0;
+	int id;
+
+	while (__atomic_load_n(&running, __ATOMIC_RELAXED)) {
+		id = object_heap_allocate(thread->heap);
+		object = object_heap_lookup(thread->heap, id);
+		if (object == NULL) {
+			thread->failed = true;
+			break;
+		}
+
+		object_heap_free(thread->heap, object);
+		count++;
+	}
+
+	thread->count = count;
+
+	return NULL;
+}
+
+int main(int argc, char *argv[])
+{
+	struct bench_thread threads[BENCH_THREADS_MAX + 1];
+	struct bench_object *object;
+	struct object_heap heap;
+	int ids[BENCH_OBJECTS_COUNT];
+	unsigned long long lookups = 0;
+	unsigned int threads_count = 4;
+	bool failed = false;
+	unsigned int i;
+
+	if (argc == 2)
+		threads_count = strtoul(argv[1], NULL, 10);
+
+	if (threads_count == 0 || threads_count > BENCH_THREADS_MAX) {
+		fprintf(stderr, "Usage: %s [threads]\n", argv[0]);
+		return 1;
+	}
+
+	object_heap_init(&heap, sizeof(struct bench_object), BENCH_ID_OFFSET,
+			 0);
+
+	for (i = 0; i < BENCH_OBJECTS_COUNT; i++) {
+		ids[i] = object_heap_allocate(&heap);
+		object = (struct bench_object *)object_heap_lookup(&heap,
+								   ids[i]);
+		object->value = ids[i];
+	}
+
+	for (i = 0; i <= threads_count; i++) {
+		threads[i].heap = &heap;
+		threads[i].ids = ids;
+		threads[i].count = 0;
+		threads[i].failed = false;
+
+		pthread_create(&threads[i].thread, NULL,
+			       i < threads_count ? bench_lookup : bench_churn,
+			       &threads[i]);
+	}
+
+	sleep(BENCH_DURATION_S);
+	__atomic_store_n(&running, false, __ATOMIC_RELAXED);
+
+	for (i = 0; i <= threads_count; i++) {
+		pthread_join(threads[i].thread, NULL);
+		failed |= threads[i].failed;
+
+		if (i < threads_count)
+			lookups += threads[i].count;
+	}
+
+	printf("%u lookup threads: %.1f Mlookups/s, %.1f Mallocs/s\n",
+	       threads_count, lookups / 1e6 / BENCH_DURATION_S,
+	       threads[threads_count].count / 1e6 / BENCH_DURATION_S);
+
+	object_heap_destroy(&heap);
+
+	if (failed) {
+		fprintf(stderr, "Lookup of a live object failed\n");
+		return 1;
+	}
+
+	return 0;
+}
@@ -0,0 +1,146 @@
+/*
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+/*
+ * Measure the throughput of every untiling kernel the CPU can run, on an NV12
+ * picture of the given size (1920x1088 by default), and of linear copies of
+ * its luma plane against plain memcpy. Buffers are regular cached memory,
+ * unlike the capture buffers the backend reads from, so the figures compare
+ * kernels rather than predict readback speed.
+ */
+
+#include "tiled_yuv_kernels.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#define BENCH_DURATION_NS	500000000ULL
+
+static unsigned long long clock_ns(void)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	return (unsigned long long)now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+static void report(const char *name, const char *function,
+		   unsigned long long bytes, unsigned long long duration)
+{
+	printf("%-8s %-30s %10.1f MB/s\n", name, function,
+	       (double)bytes * 1000.0 / duration);
+}
+
+int main(int argc, char *argv[])
+{
+	struct tiled_yuv_kernels kernels[TILED_YUV_KERNELS_MAX];
+	unsigned int width = 1920;
+	unsigned int height = 1088;
+	unsigned long long start, duration, bytes;
+	unsigned int luma_size, chroma_size;
+	unsigned int count;
+	uint8_t *src, *dst, *dst2;
+	unsigned int i;
+
+	if (argc == 3) {
+		width = strtoul(argv[1], NULL, 10);
+		height = strtoul(argv[2], NULL, 10);
+	}
+
+	if (width == 0 || height < 2) {
+		fprintf(stderr, "Usage: %s [width height]\n", argv[0]);
+		return 1;
+	}
+
+	luma_size = (width + TILE_SIZE - 1) / TILE_SIZE *
+		    ((height + TILE_SIZE - 1) / TILE_SIZE) * TILE_BYTES;
+	chroma_size = (width + TILE_SIZE - 1) / TILE_SIZE *
+		      ((height / 2 + TILE_SIZE - 1) / TILE_SIZE) * TILE_BYTES;
+
+	src = aligned_alloc(TILE_BYTES, luma_size);
+	dst = aligned_alloc(TILE_BYTES, luma_size);
+	if (src == NULL || dst == NULL)
+		return 1;
+
+	memset(src, 0x80, luma_size);
+	memset(dst, 0, luma_size);
+
+	/* Chroma planes share the destination, one after the other. */
+	dst2 = dst + chroma_size / 2;
+
+	count = tiled_yuv_kernels_list(kernels);
+
+	printf("Reading %ux%u NV12\n", width, height);
+
+	for (i = 0; i < count; i++) {
+		bytes = 0;
+		start = clock_ns();
+
+		do {
+			kernels[i].tiled_to_planar(src, dst, width, width,
+						   height);
+			bytes += width * height;
+			duration = clock_ns() - start;
+		} while (duration < BENCH_DURATION_NS);
+
+		report(kernels[i].name, "tiled_to_planar", bytes, duration);
+
+		bytes = 0;
+		start = clock_ns();
+
+		do {
+			kernels[i].tiled_deinterleave_to_planar(src, dst, dst2,
+								width / 2,
+								width,
+								height / 2);
+			bytes += width * (height / 2);
+			duration = clock_ns() - start;
+		} while (duration < BENCH_DURATION_NS);
+
+		report(kernels[i].name, "tiled_deinterleave_to_planar", bytes,
+		       duration);
+
+		bytes = 0;
+		start = clock_ns();
+
+		do {
+			kernels[i].linear_to_planar(src, dst, width * height);
+			bytes += width * height;
+			duration = clock_ns() - start;
+		} while (duration < BENCH_DURATION_NS);
+
+		report(kernels[i].name, "linear_to_planar", bytes, duration);
+	}
+
+	bytes = 0;
+	start = clock_ns();
+
+	do {
+		memcpy(dst, src, width * height);
+		bytes += width * height;
+		duration = clock_ns() - start;
+	} while (duration < BENCH_DURATION_NS);
+
+	report("libc", "memcpy", bytes, duration);
+
+	free(src);
+	free(dst);
+
+	return 0;
+}
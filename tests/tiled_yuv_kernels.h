@@ -0,0 +1,84 @@
+/*
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#ifndef _TILED_YUV_KERNELS_H_
+#define _TILED_YUV_KERNELS_H_
+
+/*
+ * The kernels are static to the backend, so they are built along with the
+ * test programs to be called one by one instead of through the dispatch.
+ */
+#include "tiled_yuv.c"
+
+#define TILED_YUV_KERNELS_MAX	8
+
+struct tiled_yuv_kernels {
+	const char *name;
+	tiled_to_planar_t tiled_to_planar;
+	tiled_deinterleave_to_planar_t tiled_deinterleave_to_planar;
+	linear_to_planar_t linear_to_planar;
+};
+
+/* List the kernels that can run on the CPU, the C ones first. */
+static unsigned int tiled_yuv_kernels_list(struct tiled_yuv_kernels *kernels)
+{
+	unsigned int count = 0;
+
+	kernels[count++] = (struct tiled_yuv_kernels) {
+		"c", tiled_to_planar_c, tiled_deinterleave_to_planar_c,
+		linear_to_planar_c
+	};
+
+#if defined(__arm__)
+	if (getauxval(AT_HWCAP) & HWCAP_NEON)
+		kernels[count++] = (struct tiled_yuv_kernels) {
+			"neon", tiled_to_planar_neon,
+			tiled_deinterleave_to_planar_neon, linear_to_planar_c
+		};
+#elif defined(__aarch64__)
+	kernels[count++] = (struct tiled_yuv_kernels) {
+		"neon", tiled_to_planar_neon,
+		tiled_deinterleave_to_planar_neon, linear_to_planar_neon
+	};
+#elif defined(__x86_64__) || defined(__i386__)
+	__builtin_cpu_init();
+
+	if (__builtin_cpu_supports("sse2"))
+		kernels[count++] = (struct tiled_yuv_kernels) {
+			"sse2", tiled_to_planar_sse2,
+			tiled_deinterleave_to_planar_sse2, linear_to_planar_c
+		};
+
+	if (__builtin_cpu_supports("sse4.1"))
+		kernels[count++] = (struct tiled_yuv_kernels) {
+			"sse4.1", tiled_to_planar_sse41,
+			tiled_deinterleave_to_planar_sse41,
+			linear_to_planar_sse41
+		};
+
+	if (__builtin_cpu_supports("avx2"))
+		kernels[count++] = (struct tiled_yuv_kernels) {
+			"avx2", tiled_to_planar_avx2,
+			tiled_deinterleave_to_planar_avx2,
+			linear_to_planar_avx2
+		};
+#endif
+
+	return count;
+}
+
+#endif
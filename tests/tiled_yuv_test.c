@@ -0,0 +1,258 @@
+/*
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+/*
+ * Check every untiling kernel the CPU can run against a reference that
+ * addresses each pixel on its own, on sizes that leave partial tiles and
+ * tail columns, and linear copies against memcpy on sizes that leave partial
+ * blocks. Destination padding must be left untouched.
+ */
+
+#include "tiled_yuv_kernels.h"
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#define GUARD_BYTE		0xa5
+#define PITCH_PADDING		13
+
+static const unsigned int widths[] = {
+	1, 2, 15, 16, 17, 31, 32, 33, 47, 63, 64, 65, 95, 127, 721, 1920
+};
+
+static const unsigned int heights[] = {
+	1, 2, 7, 31, 32, 33, 47, 64, 65, 97
+};
+
+static const unsigned int linear_sizes[] = {
+	0, 1, 15, 16, 63, 64, 65, 127, 128, 1000, 4096, 4113, 65599
+};
+
+static unsigned int tiled_size(unsigned int width, unsigned int height)
+{
+	unsigned int tiles_width = (width + TILE_SIZE - 1) / TILE_SIZE;
+	unsigned int tiles_height = (height + TILE_SIZE - 1) / TILE_SIZE;
+
+	return tiles_width * tiles_height * TILE_BYTES;
+}
+
+static uint8_t tiled_pixel(uint8_t *src, unsigned int width, unsigned int x,
+			   unsigned int y)
+{
+	unsigned int tiles_width = (width + TILE_SIZE - 1) / TILE_SIZE;
+	unsigned int tile = y / TILE_SIZE * tiles_width + x / TILE_SIZE;
+
+	return src[tile * TILE_BYTES + y % TILE_SIZE * TILE_SIZE +
+		   x % TILE_SIZE];
+}
+
+static void reference_tiled_to_planar(uint8_t *src, uint8_t *dst,
+				      unsigned int dst_pitch,
+				      unsigned int width, unsigned int height)
+{
+	unsigned int x, y;
+
+	for (y = 0; y < height; y++)
+		for (x = 0; x < width; x++)
+			dst[y * dst_pitch + x] = tiled_pixel(src, width, x, y);
+}
+
+static void reference_tiled_deinterleave_to_planar(uint8_t *src,
+						   uint8_t *dst1,
+						   uint8_t *dst2,
+						   unsigned int dst_pitch,
+						   unsigned int width,
+						   unsigned int height)
+{
+	unsigned int x, y;
+
+	for (y = 0; y < height; y++) {
+		for (x = 0; x < width / 2; x++) {
+			dst1[y * dst_pitch + x] =
+				tiled_pixel(src, width, 2 * x, y);
+			dst2[y * dst_pitch + x] =
+				tiled_pixel(src, width, 2 * x + 1, y);
+		}
+	}
+}
+
+static void fill_random(uint8_t *data, unsigned int size)
+{
+	unsigned int i;
+
+	for (i = 0; i < size; i++)
+		data[i] = rand();
+}
+
+static bool check(const char *name, const char *function, uint8_t *expected,
+		  uint8_t *result, unsigned int size, unsigned int width,
+		  unsigned int height)
+{
+	unsigned int i;
+
+	for (i = 0; i < size; i++) {
+		if (expected[i] == result[i])
+			continue;
+
+		fprintf(stderr, "%s: %s mismatch for %ux%u at offset %u\n",
+			name, function, width, height, i);
+		return false;
+	}
+
+	return true;
+}
+
+static bool test_size(struct tiled_yuv_kernels *kernels, uint8_t *src,
+		      unsigned int width, unsigned int height)
+{
+	unsigned int dst_pitch = width + PITCH_PADDING;
+	unsigned int dst_size = dst_pitch * height;
+	uint8_t *expected, *result;
+	bool success = false;
+
+	expected = malloc(2 * dst_size);
+	result = malloc(2 * dst_size);
+	if (expected == NULL || result == NULL)
+		goto complete;
+
+	memset(expected, GUARD_BYTE, 2 * dst_size);
+	memset(result, GUARD_BYTE, 2 * dst_size);
+
+	reference_tiled_to_planar(src, expected, dst_pitch, width, height);
+	kernels->tiled_to_planar(src, result, dst_pitch, width, height);
+
+	if (!check(kernels->name, "tiled_to_planar", expected, result,
+		   dst_size, width, height))
+		goto complete;
+
+	memset(expected, GUARD_BYTE, 2 * dst_size);
+	memset(result, GUARD_BYTE, 2 * dst_size);
+
+	reference_tiled_deinterleave_to_planar(src, expected,
+					       expected + dst_size,
+					       dst_pitch, width, height);
+	kernels->tiled_deinterleave_to_planar(src, result, result + dst_size,
+					      dst_pitch, width, height);
+
+	if (!check(kernels->name, "tiled_deinterleave_to_planar", expected,
+		   result, 2 * dst_size, width, height))
+		goto complete;
+
+	success = true;
+
+complete:
+	free(expected);
+	free(result);
+
+	return success;
+}
+
+/* The destination is shifted out of alignment, which kernels must handle. */
+static bool test_linear_size(struct tiled_yuv_kernels *kernels, uint8_t *src,
+			     unsigned int size)
+{
+	uint8_t *expected, *result;
+	bool success = false;
+
+	expected = malloc(size + PITCH_PADDING);
+	result = malloc(size + PITCH_PADDING + 1);
+	if (expected == NULL || result == NULL)
+		goto complete;
+
+	memset(expected, GUARD_BYTE, size + PITCH_PADDING);
+	memset(result, GUARD_BYTE, size + PITCH_PADDING + 1);
+
+	memcpy(expected, src, size);
+	kernels->linear_to_planar(src, result + 1, size);
+
+	success = check(kernels->name, "linear_to_planar", expected,
+			result + 1, size + PITCH_PADDING, size, 1);
+
+complete:
+	free(expected);
+	free(result);
+
+	return success;
+}
+
+static bool test_kernels(struct tiled_yuv_kernels *kernels, uint8_t *src)
+{
+	unsigned int i, j;
+
+	for (i = 0; i < sizeof(widths) / sizeof(*widths); i++)
+		for (j = 0; j < sizeof(heights) / sizeof(*heights); j++)
+			if (!test_size(kernels, src, widths[i], heights[j]))
+				return false;
+
+	for (i = 0; i < sizeof(linear_sizes) / sizeof(*linear_sizes); i++)
+		if (!test_linear_size(kernels, src, linear_sizes[i]))
+			return false;
+
+	return true;
+}
+
+int main(void)
+{
+	struct tiled_yuv_kernels kernels[TILED_YUV_KERNELS_MAX + 2];
+	unsigned int count;
+	unsigned int size;
+	uint8_t *src;
+	bool success = true;
+	unsigned int i;
+
+	size = tiled_size(widths[sizeof(widths) / sizeof(*widths) - 1],
+			  heights[sizeof(heights) / sizeof(*heights) - 1]);
+
+	/* One more tile leaves room to shift the source out of alignment. */
+	src = aligned_alloc(TILE_BYTES, size + TILE_BYTES);
+	if (src == NULL)
+		return 1;
+
+	fill_random(src, size + TILE_BYTES);
+
+	count = tiled_yuv_kernels_list(kernels);
+
+	/* The public entry points, with the kernel selected for the CPU. */
+	tiled_yuv_init();
+
+	kernels[count++] = (struct tiled_yuv_kernels) {
+		"dispatch", tiled_to_planar, tiled_deinterleave_to_planar,
+		linear_to_planar
+	};
+
+	for (i = 0; i < count; i++) {
+		if (test_kernels(&kernels[i], src)) {
+			printf("PASS: %s\n", kernels[i].name);
+		} else {
+			printf("FAIL: %s\n", kernels[i].name);
+			success = false;
+		}
+	}
+
+	/* Sources that are not aligned take the C kernels. */
+	if (test_kernels(&kernels[count - 1], src + 1)) {
+		printf("PASS: dispatch (unaligned)\n");
+	} else {
+		printf("FAIL: dispatch (unaligned)\n");
+		success = false;
+	}
+
+	free(src);
+
+	return success ? 0 : 1;
+}